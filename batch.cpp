@@ -0,0 +1,290 @@
+/*
+ * batch.cpp
+ *
+ * The file list is worked out up front, so files we write while we go never end up in
+ * it. Each thread is a worker that takes the next file off the list until there are
+ * none left, so a few big files don't hold up a thread while the others sit idle. A
+ * worker works each file on its own (the stages inside run on one thread) in arenas it
+ * keeps for the whole batch, so after its first file it makes no big allocations.
+ */
+#include "batch.h"
+#include "padding.h"
+#include <atomic>
+#include <chrono>
+
+/*
+ * This function checks whether a name has wildcards in it.
+ *
+ * @param name                      file name from the command line
+ *
+ * @return                          true if it has a '*' or '?'
+ */
+static bool hasWildcard(const std::string& name)
+{
+    return name.find_first_of("*?") != std::string::npos;
+}
+
+/*
+ * This function checks if the command line is a batch rather than one plain file.
+ *
+ * @param names                     every name given after -f
+ *
+ * @return                          true for more than one name, a wildcard or a directory
+ */
+bool isBatch(const std::vector<std::string>& names)
+{
+    if (names.size() != 1)
+        return true;
+
+    std::error_code error;
+    return hasWildcard(names[0]) || std::filesystem::is_directory(names[0], error);
+}
+
+/*
+ * This function matches a file name against a pattern, '*' is any run of characters
+ * and '?' is any one character. When a '*' doesn't work out we go back and let it
+ * take one more character, which is all the backtracking it ever needs.
+ *
+ * @param pattern                   pattern with wildcards
+ * @param name                      file name to check
+ *
+ * @return                          true if it matches
+ */
+bool matchWildcard(const std::string& pattern, const std::string& name)
+{
+    size_t p = 0, n = 0;
+    size_t star = std::string::npos, retry = 0;
+
+    while (n < name.size())
+    {
+        if ((p < pattern.size()) && ((pattern[p] == '?') || (pattern[p] == name[n])))
+        {
+            p++;
+            n++;
+        }
+        else if ((p < pattern.size()) && (pattern[p] == '*'))
+        {
+            star = p++;
+            retry = n;
+        }
+        else if (star != std::string::npos)
+        {
+            p = star + 1;
+            n = ++retry;
+        }
+        else
+            return false;
+    }
+
+    while ((p < pattern.size()) && (pattern[p] == '*'))
+        p++;
+
+    return p == pattern.size();
+}
+
+/*
+ * This function checks a file we found in a directory is one we want. Encoding skips
+ * files we've already encoded, decoding only takes those.
+ *
+ * @param path                      file found
+ * @param encoding                  true to encode, false to decode
+ *
+ * @return                          true to add it to the batch
+ */
+static bool wantFile(const std::filesystem::path& path, bool encoding)
+{
+    bool encoded = (path.extension() == "." + FILE_EXTENSION);
+    return encoding ? !encoded : encoded;
+}
+
+/*
+ * This function works out every file a batch is made of. A plain name is taken as it
+ * is, if it isn't there we find out when we try to open it. A wildcard in the file
+ * name part matches files in its directory. A directory gives us the files in it, and
+ * with recursive everything under it too, each remembering which directory it was in
+ * so the output can mirror the tree.
+ *
+ * @param names                     every name given after -f
+ * @param recursive                 walk down into directories
+ * @param encoding                  true to encode, false to decode
+ * @param files                     the files of the batch, in order
+ *
+ * @return                          false if there's nothing to do
+ */
+bool collectBatchFiles(const std::vector<std::string>& names, bool recursive, bool encoding, std::vector<BatchFile>& files)
+{
+    namespace fs = std::filesystem;
+    std::error_code error;
+
+    for (const std::string& name : names)
+    {
+        fs::path path(name);
+        std::vector<BatchFile> found;
+
+        if (hasWildcard(path.filename().string()))
+        {
+            fs::path directory = path.parent_path();
+            for (const fs::directory_entry& entry : fs::directory_iterator(directory.empty() ? fs::path(".") : directory, error))
+            {
+                if (entry.is_regular_file(error) && matchWildcard(path.filename().string(), entry.path().filename().string()))
+                    found.push_back({ (directory / entry.path().filename()).string(), "" });
+            }
+
+            if (found.empty())
+                std::cerr << "No files match " << name << std::endl;
+        }
+        else if (fs::is_directory(path, error))
+        {
+            auto add = [&](const fs::directory_entry& entry)
+            {
+                if (entry.is_regular_file(error) && wantFile(entry.path(), encoding))
+                {
+                    std::string relativeDir = entry.path().parent_path().lexically_relative(path).string();
+                    found.push_back({ entry.path().string(), (relativeDir == ".") ? "" : relativeDir });
+                }
+            };
+
+            if (recursive)
+                for (const fs::directory_entry& entry : fs::recursive_directory_iterator(path, error))
+                    add(entry);
+            else
+                for (const fs::directory_entry& entry : fs::directory_iterator(path, error))
+                    add(entry);
+        }
+        else
+            found.push_back({ name, "" });
+
+        std::sort(found.begin(), found.end(), [](const BatchFile& a, const BatchFile& b) { return a.path < b.path; });
+        files.insert(files.end(), found.begin(), found.end());
+    }
+
+    if (files.empty())
+    {
+        std::cerr << "No files to " << (encoding ? "encode." : "decode.") << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * This function checks no two files of a batch we're encoding would be written to the
+ * same place, a.txt and a.md both make a.khn. Decoded names come out of the headers, so
+ * we can't know those until we get there, see runBatch.
+ *
+ * @param files                     files to encode, see collectBatchFiles
+ * @param options                   output directory, see JobOptions
+ *
+ * @return                          false if any two files would collide
+ */
+static bool checkOutputNames(const std::vector<BatchFile>& files, const JobOptions& options)
+{
+    namespace fs = std::filesystem;
+    std::map<fs::path, size_t> outputs;
+    bool ok = true;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        // where encode will write it, worked out without making any directories
+        fs::path output(getOutputFilename(files[i].path));
+        if (!options.outputDir.empty())
+            output = fs::path(options.outputDir) / files[i].relativeDir / output.filename();
+
+        auto [found, added] = outputs.emplace(output.lexically_normal(), i);
+        if (!added)
+        {
+            std::cerr << files[i].path << " and " << files[found->second].path << " would both be written to " << found->first.string() << std::endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+/*
+ * This function encodes or decodes every file of a batch, then sums up how it went.
+ * With an output directory, each file goes in the same place under it as it was under
+ * the directory it was found in.
+ *
+ * A batch never stops to ask about an output file that's already there, no one may be
+ * watching and every other thread would wait too. Unless we've been told what to do
+ * with them (see ExistingFile) that file fails, which also catches two decoded files
+ * with the same name.
+ *
+ * Memory: an arena (two buffers, up to 16MB each) for every thread, see CubeArena.
+ *
+ * @param files                     files to work, see collectBatchFiles
+ * @param schedule                  key tables, worked out once for every file
+ * @param encoding                  true to encode, false to decode
+ * @param options                   output directory and O_DIRECT, see JobOptions
+ * @param pool                      threads to share the files out across
+ *
+ * @return                          false if any file failed, or they can't all be written
+ */
+bool runBatch(const std::vector<BatchFile>& files, const KeySchedule& schedule, bool encoding, const JobOptions& options, ThreadPool& pool)
+{
+    if (encoding && (checkOutputNames(files, options) == false))
+        return false;
+
+    // a padding stream for every file, taken here so it doesn't matter which thread gets which file
+    uint64_t firstStream = reservePaddingStreams(files.size());
+
+    std::vector<std::vector<CubeArena>> arenas(pool.size());
+    std::vector<uint8_t> failed(files.size(), 0);
+
+    std::atomic<size_t> next{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    size_t done = 0;
+    std::mutex progress;
+
+    auto start = std::chrono::steady_clock::now();
+
+    pool.parallelFor(pool.size(), [&](size_t firstWorker, size_t lastWorker)
+    {
+        ThreadPool serial(1);
+
+        for (size_t worker = firstWorker; worker < lastWorker; worker++)
+        {
+            for (size_t i = next++; i < files.size(); i = next++)
+            {
+                JobOptions fileOptions = options;
+                fileOptions.quiet = true;
+                if (fileOptions.existing == ExistingFile::ASK)
+                    fileOptions.existing = ExistingFile::FAIL;
+                fileOptions.paddingStream = firstStream + i;
+                if (!options.outputDir.empty())
+                    fileOptions.outputDir = (std::filesystem::path(options.outputDir) / files[i].relativeDir).string();
+
+                MappedFile input;
+                bool ok = openInputFile(files[i].path, encoding, input)
+                    && processFile(files[i].path, input, schedule, arenas[worker], serial, encoding, fileOptions);
+
+                if (ok)
+                    bytes += input.size();
+                else
+                    failed[i] = 1;
+
+                std::lock_guard<std::mutex> lock(progress);
+                done++;
+                if (options.verbose)
+                    std::cout << files[i].path << (ok ? " done." : " failed.") << std::endl;
+                else
+                    drawProgressBar(float(done) / files.size());
+            }
+        }
+    });
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double megabytes = double(bytes) / ONE_MEGABYTE;
+    size_t failures = size_t(std::count(failed.begin(), failed.end(), 1));
+
+    std::cout << std::endl << (encoding ? "Encoded " : "Decoded ") << files.size() - failures << " of " << files.size()
+        << " files, " << std::fixed << std::setprecision(1) << megabytes << "MB in " << seconds << "s ("
+        << ((seconds > 0) ? megabytes / seconds : 0.0) << "MB/s)" << std::endl;
+
+    for (size_t i = 0; i < files.size(); i++)
+        if (failed[i])
+            std::cerr << "Failed: " << files[i].path << std::endl;
+
+    return failures == 0;
+}
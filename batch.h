@@ -0,0 +1,21 @@
+/*
+ * batch.h
+ * This file contains batch mode: working out every file a command line names (lists of
+ * files, wildcards and directories) and encoding or decoding them all in one run, the
+ * files shared out across the thread pool.
+ *
+*/
+#pragma once
+#include "file_encryptor.h"
+
+// One file of a batch, and where under the output directory it's mirrored to
+struct BatchFile
+{
+	std::string path;
+	std::string relativeDir;
+};
+
+bool	collectBatchFiles(const std::vector<std::string>& names, bool recursive, bool encoding, std::vector<BatchFile>& files);
+bool	isBatch(const std::vector<std::string>& names);
+bool	matchWildcard(const std::string& pattern, const std::string& name);
+bool	runBatch(const std::vector<BatchFile>& files, const KeySchedule& schedule, bool encoding, const JobOptions& options, ThreadPool& pool);
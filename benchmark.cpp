@@ -0,0 +1,720 @@
+/*
+ * benchmark.cpp
+ *
+ * Stand alone timing for the cube stages, so we can compare before and after when
+ * we change one of them. Runs on a full 16 MB cube of random bytes with a random key.
+ *
+ * shuffle:     the original counter and std::sort final shuffle against the closed
+ *              form gather in rubix.cpp, both directions, and checks they agree
+ * xor:         every XOR kernel this machine supports on a 12 MB buffer, against a
+ *              plain memcpy of the same buffer for the memory bandwidth
+ * threads:     Rubix shift and final shuffle at 1, 2, 4, ... threads up to the core
+ *              count (at least 4), checking every count gives the 1 thread cube
+ * stream:      a whole 30 MB streamed file encoded at 1, 2, 4, ... threads, checking
+ *              every count writes the same .khn, padding and all
+ * padding:     the original per byte mt19937 padding against every ChaCha20 kernel
+ *              this machine supports, checking them against the published test vector
+ * stages:      every stage of a cube on its own, as file_encryptor calls it, for inputs
+ *              of 1 KB to 12 MB of zeros, English text, binary and white noise. MB/s
+ *              and cycles per byte are of the input, so a small file shows what it
+ *              really costs to put it through the cube it gets. Also checks a cube of a
+ *              size we never write is turned away rather than taking the process down
+ *
+ * Name the sections to run on the command line, or nothing for all of them. Links
+ * against libkhn for the stages.
+ */
+#include "file_encryptor.h"
+#include "huffman.h"
+#include "key_schedule.h"
+#include "padding.h"
+#include "rubix.h"
+#include "xor_kernel.h"
+#include <cstring>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BENCHMARK_CYCLES 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#else
+#define BENCHMARK_CYCLES 0
+#endif
+
+constexpr int BENCHMARK_RUNS = 3;
+
+/*
+ * This function reads the time stamp counter, which ticks at the CPU's base clock.
+ * 0 where there isn't one.
+ *
+ * @param   none
+ * @return  uint64_t                cycles
+ */
+static uint64_t readCycles()
+{
+#if BENCHMARK_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * This function times a stage, keeping the best of a few runs.
+ *
+ * @param stage                     stage to run
+ * @param cycles                    cycles the best run took
+ *
+ * @return                          best time in milliseconds
+ */
+template <typename F>
+double timeStage(F stage, double& cycles)
+{
+    double best = 0;
+    for (int run = 0; run < BENCHMARK_RUNS; run++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startCycles = readCycles();
+        stage();
+        uint64_t endCycles = readCycles();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        if ((run == 0) || (elapsed.count() < best))
+        {
+            best = elapsed.count();
+            cycles = double(endCycles - startCycles);
+        }
+    }
+
+    return best;
+}
+
+/*
+ * This function times a stage, keeping the best of a few runs.
+ *
+ * @param stage                     stage to run
+ *
+ * @return                          best time in milliseconds
+ */
+template <typename F>
+double timeStage(F stage)
+{
+    double cycles;
+    return timeStage(stage, cycles);
+}
+
+/*
+ * This function is the final shuffle as it was originally written, tag every slot with
+ * a counter in the upper bytes then sort.
+ *
+ * @param rubix                     cube to shuffle, in place
+ * @param prime                     prime from getPrime()
+ *
+ * @return                          void
+ */
+void sortShuffleEncode(std::vector<uint32_t>& rubix, uint32_t prime)
+{
+    uint32_t counter = 1;
+    for (uint32_t i = 1; i < rubix.size(); i++)
+    {
+        rubix[rubix.size() - (i * prime) % rubix.size()] &= 0xff;
+        rubix[rubix.size() - (i * prime) % rubix.size()] |= counter++ << 8;
+    }
+    std::sort(rubix.begin(), rubix.end());
+}
+
+/*
+ * This function is the original decode side of the final shuffle.
+ *
+ * @param rubix                     cube to unshuffle, in place
+ * @param prime                     prime from getPrime()
+ *
+ * @return                          void
+ */
+void sortShuffleDecode(std::vector<uint32_t>& rubix, uint32_t prime)
+{
+    uint32_t counter = 1;
+    for (uint32_t i = 1; i < rubix.size(); i++)
+        rubix[counter++] |= (rubix.size() - ((i * prime) % rubix.size())) << 8;
+
+    std::sort(rubix.begin(), rubix.end());
+}
+
+/*
+ * This function compares the low bytes of two cubes.
+ *
+ * @param left                      first cube
+ * @param right                     second cube
+ *
+ * @return                          true if they match
+ */
+template <typename L, typename R>
+bool sameBytes(const std::vector<L>& left, const std::vector<R>& right)
+{
+    if (left.size() != right.size())
+        return false;
+
+    for (size_t i = 0; i < left.size(); i++)
+        if ((left[i] & 0xff) != (right[i] & 0xff))
+            return false;
+
+    return true;
+}
+
+/*
+ * This function benchmarks the final shuffle.
+ *
+ * @param cube                      random cube to shuffle
+ * @param prime                     prime to shuffle with
+ *
+ * @return                          true if both versions agree
+ */
+bool benchmarkShuffle(const std::vector<FILE_BUFFER_TYPE>& cube, uint32_t prime)
+{
+    ThreadPool pool(1);
+    std::vector<uint32_t> sorted;
+    std::vector<FILE_BUFFER_TYPE> gathered(SIXTEEN_MEGABYTES), restored(SIXTEEN_MEGABYTES);
+
+    double sortEncode = timeStage([&]() { sorted.assign(cube.begin(), cube.end()); sortShuffleEncode(sorted, prime); });
+    double gatherEncode = timeStage([&]() { shuffleEncode(cube.data(), gathered, prime, pool); });
+    bool encodeMatches = sameBytes(sorted, gathered);
+
+    double sortDecode = timeStage([&]() { sorted.assign(gathered.begin(), gathered.end()); sortShuffleDecode(sorted, prime); });
+    double gatherDecode = timeStage([&]() { shuffleDecode(gathered.data(), restored, prime, pool); });
+    bool decodeMatches = sameBytes(sorted, restored) && sameBytes(cube, restored);
+
+    std::cout << std::fixed << std::setprecision(1)
+        << "shuffle encode\tsort " << std::setw(8) << sortEncode << " ms\tgather " << std::setw(8) << gatherEncode << " ms\t"
+        << (encodeMatches ? "match" : "MISMATCH") << '\n'
+        << "shuffle decode\tsort " << std::setw(8) << sortDecode << " ms\tgather " << std::setw(8) << gatherDecode << " ms\t"
+        << (decodeMatches ? "match" : "MISMATCH") << '\n';
+
+    return encodeMatches && decodeMatches;
+}
+
+/*
+ * This function benchmarks the XOR kernels on the largest file we can encrypt and
+ * checks each one against the original byte at a time loop.
+ *
+ * @param key                       prepared key
+ * @param gen                       random number generator for the test data
+ *
+ * @return                          true if every kernel matched
+ */
+bool benchmarkXor(const std::vector<uint8_t>& key, std::mt19937& gen)
+{
+    std::vector<uint8_t> input(TWELVE_MEGABYTES), expected, output(TWELVE_MEGABYTES);
+    for (uint8_t& b : input)
+        b = uint8_t(gen());
+
+    // the original loop, a byte and a modulo at a time
+    expected = input;
+    double original = timeStage([&]()
+    {
+        int k = 0;
+        for (uint8_t& b : expected)
+        {
+            b ^= key[k];
+            k = (k + 1) % MAX_KEY_SIZE;
+        }
+    });
+
+    // odd number of runs, so expected ends up XORed once
+    static_assert(BENCHMARK_RUNS % 2 == 1, "XOR reference needs an odd number of runs");
+
+    std::vector<uint8_t> pad;
+    buildKeyPad(key, pad);
+
+    double megabytes = double(TWELVE_MEGABYTES) / ONE_MEGABYTE;
+    double copy = timeStage([&]() { std::memcpy(output.data(), input.data(), input.size()); });
+
+    std::cout << std::fixed << std::setprecision(1)
+        << "xor memcpy\t" << std::setw(8) << copy << " ms\t" << std::setw(8) << megabytes / (copy / 1000) << " MB/s\n"
+        << "xor original\t" << std::setw(8) << original << " ms\t" << std::setw(8) << megabytes / (original / 1000) << " MB/s\n";
+
+    bool ok = true;
+    for (const XorKernel& kernel : getXorKernels())
+    {
+        if (!kernel.supported)
+        {
+            std::cout << "xor " << kernel.name << "\tnot supported\n";
+            continue;
+        }
+
+        // XOR is its own inverse, so we can run it over the same buffer as often as we like
+        output = input;
+        double elapsed = timeStage([&]() { xorWithPad(output.data(), output.size(), pad, kernel.function); });
+
+        output = input;
+        xorWithPad(output.data(), output.size(), pad, kernel.function);
+        bool matches = (output == expected);
+        ok = ok && matches;
+
+        std::cout << "xor " << kernel.name << "\t" << std::setw(8) << elapsed << " ms\t"
+            << std::setw(8) << megabytes / (elapsed / 1000) << " MB/s\t" << (matches ? "match" : "MISMATCH") << '\n';
+    }
+
+    return ok;
+}
+
+/*
+ * This function benchmarks the Rubix shift and final shuffle across thread counts. The
+ * output has to be byte for byte the same whatever the thread count.
+ *
+ * @param cube                      random cube to shift and shuffle
+ * @param key                       prepared key
+ *
+ * @return                          true if every thread count matched 1 thread
+ */
+bool benchmarkThreads(const std::vector<FILE_BUFFER_TYPE>& cube, const std::vector<uint8_t>& key)
+{
+    RubixShifts shifts;
+    getRubixShifts(key, shifts);
+    uint32_t prime = getPrime(key[59]);
+
+    unsigned maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    std::vector<FILE_BUFFER_TYPE> work, scratch(SIXTEEN_MEGABYTES), single;
+    bool ok = true;
+
+    for (unsigned threads = 1; threads <= maxThreads && threads <= MAX_THREADS; threads *= 2)
+    {
+        ThreadPool pool(threads);
+
+        double rubix = timeStage([&]() { work.assign(cube.begin(), cube.end()); rubixEncode(work, scratch, shifts, pool); });
+        double shuffle = timeStage([&]() { shuffleEncode(work.data(), scratch, prime, pool); });
+
+        if (threads == 1)
+            single = scratch;
+        bool matches = (scratch == single);
+
+        rubixDecode(work, scratch, shifts, pool);
+        matches = matches && (work == cube);
+        ok = ok && matches;
+
+        std::cout << std::fixed << std::setprecision(1)
+            << "threads " << std::setw(3) << threads << "	rubix " << std::setw(8) << rubix << " ms	shuffle "
+            << std::setw(8) << shuffle << " ms	" << (matches ? "match" : "MISMATCH") << '\n';
+    }
+
+    return ok;
+}
+
+/*
+ * This function encodes a streamed file, start to finish the way file_encryptor does,
+ * across thread counts. The blocks go to whichever thread is free, so this is where
+ * anything that depends on the order threads get to it shows up. The .khn has to be
+ * byte for byte the same whatever the thread count.
+ *
+ * @param key                       key bytes
+ * @param gen                       random numbers for the file
+ *
+ * @return                          true if every thread count matched 1 thread
+ */
+bool benchmarkStream(const std::vector<uint8_t>& key, std::mt19937& gen)
+{
+    KeySchedule schedule;
+    buildKeySchedule(key, schedule);
+
+    const std::string inputFile = "benchmark_stream.bin";
+    const std::string outputDir = "benchmark_stream";
+    const std::string outputFile = (std::filesystem::path(outputDir) / getOutputFilename(inputFile)).string();
+
+    // three and a bit blocks, so there's a short one at the end
+    std::vector<uint8_t> file(30'000'000);
+    std::uniform_int_distribution<> distrib(0, 0xff);
+    for (uint8_t& b : file)
+        b = uint8_t(distrib(gen));
+
+    std::ofstream(inputFile, std::ios::binary).write(reinterpret_cast<const char*>(file.data()), std::streamsize(file.size()));
+
+    // the same padding stream every time, as if each run were the first file of the process
+    JobOptions options;
+    options.quiet = true;
+    options.existing = ExistingFile::OVERWRITE;
+    options.outputDir = outputDir;
+    options.paddingStream = 0;
+
+    unsigned maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    std::vector<uint8_t> single;
+    bool ok = true;
+
+    for (unsigned threads = 1; threads <= maxThreads && threads <= MAX_THREADS; threads *= 2)
+    {
+        ThreadPool pool(threads);
+        std::vector<CubeArena> arenas;
+        bool encoded = false;
+
+        double elapsed = timeStage([&]()
+        {
+            MappedFile input;
+            encoded = input.open(inputFile) && processFile(inputFile, input, schedule, arenas, pool, true, options);
+        });
+
+        std::ifstream output(outputFile, std::ios::binary);
+        std::vector<uint8_t> khn((std::istreambuf_iterator<char>(output)), std::istreambuf_iterator<char>());
+
+        if (threads == 1)
+            single = khn;
+        bool matches = encoded && (khn == single);
+        ok = ok && matches;
+
+        std::cout << std::fixed << std::setprecision(1)
+            << "stream  " << std::setw(3) << threads << "\tencode " << std::setw(8) << elapsed << " ms\t"
+            << (matches ? "match" : "MISMATCH") << '\n';
+    }
+
+    std::error_code error;
+    std::filesystem::remove(inputFile, error);
+    std::filesystem::remove_all(outputDir, error);
+
+    return ok;
+}
+
+/*
+ * This function benchmarks the padding on a whole cube's worth, the most a cube can
+ * need, and checks each ChaCha20 kernel against the all zero key test vector and the
+ * plain kernel.
+ *
+ * @param   none
+ * @return  bool                    true if every kernel matched
+ */
+bool benchmarkPadding()
+{
+    size_t blocks = (SIXTEEN_MEGABYTES - META_DATA_SIZE) / CHACHA_BLOCK_SIZE;
+    size_t length = blocks * CHACHA_BLOCK_SIZE;
+    std::vector<uint8_t> output(length), expected(length);
+
+    // the original addPadding, a new generator every cube and a draw per byte
+    double original = timeStage([&]()
+    {
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        std::uniform_int_distribution<> distrib(0, 0xff);
+
+        for (uint8_t& b : output)
+            b = uint8_t(distrib(gen));
+    });
+
+    // first 16 bytes of ChaCha20 with an all zero key, nonce and counter
+    const uint8_t vector[16] = { 0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28 };
+
+    uint8_t key[32] = { 0 };
+    uint32_t state[16];
+    initChaChaState(key, 0, state);
+
+    getPaddingKernels().back().function(state, 0, expected.data(), blocks);
+
+    double megabytes = double(length) / ONE_MEGABYTE;
+    std::cout << std::fixed << std::setprecision(1)
+        << "padding original\t" << std::setw(8) << original << " ms\t" << std::setw(8) << megabytes / (original / 1000) << " MB/s\n";
+
+    bool ok = true;
+    for (const PaddingKernel& kernel : getPaddingKernels())
+    {
+        if (!kernel.supported)
+        {
+            std::cout << "padding " << kernel.name << "\tnot supported\n";
+            continue;
+        }
+
+        double elapsed = timeStage([&]() { kernel.function(state, 0, output.data(), blocks); });
+
+        bool matches = (std::memcmp(output.data(), vector, sizeof(vector)) == 0) && (output == expected);
+        ok = ok && matches;
+
+        std::cout << "padding " << kernel.name << "\t" << std::setw(8) << elapsed << " ms\t"
+            << std::setw(8) << megabytes / (elapsed / 1000) << " MB/s\t" << (matches ? "match" : "MISMATCH") << '\n';
+    }
+
+    return ok;
+}
+
+/*
+ * This function makes test input of one of the data profiles. The text is words picked
+ * at random, so it compresses like English, the binary is little endian records of
+ * counters, small numbers and zero fill, like a lot of program data.
+ *
+ * @param profile                   "zeros", "text", "binary" or "noise"
+ * @param size                      number of bytes
+ * @param gen                       random number generator
+ *
+ * @return                          input
+ */
+static std::vector<uint8_t> makeProfile(const std::string& profile, size_t size, std::mt19937& gen)
+{
+    std::vector<uint8_t> data(size, 0);
+
+    if (profile == "text")
+    {
+        static const char* words[] = { "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was",
+            "with", "be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have",
+            "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been",
+            "encryption", "cube", "shuffle", "file", "key", "program", "system", "number", "people", "time" };
+        std::uniform_int_distribution<size_t> pick(0, std::size(words) - 1);
+
+        size_t i = 0;
+        for (size_t word = 0; i < size; word++)
+        {
+            for (const char* c = words[pick(gen)]; *c && (i < size); c++)
+                data[i++] = uint8_t(*c);
+
+            if (i < size)
+                data[i++] = uint8_t((word % 12 == 11) ? '\n' : ((word % 7 == 6) ? '.' : ' '));
+        }
+    }
+    else if (profile == "binary")
+    {
+        std::uniform_int_distribution<uint32_t> small(0, 999);
+        for (size_t i = 0; i + 16 <= size; i += 16)
+        {
+            uint32_t record[4] = { uint32_t(i / 16), small(gen), uint32_t(gen()) & 0xffff, 0 };
+            std::memcpy(data.data() + i, record, sizeof(record));
+        }
+    }
+    else if (profile == "noise")
+    {
+        for (uint8_t& b : data)
+            b = uint8_t(gen());
+    }
+
+    return data;
+}
+
+/*
+ * This function prints one stage's line of the matrix.
+ *
+ * @param stage                     stage name
+ * @param profile                   data profile
+ * @param size                      input size in bytes
+ * @param elapsed                   best time in milliseconds
+ * @param cycles                    cycles the best run took
+ *
+ * @return                          void
+ */
+static void printStage(const char* stage, const std::string& profile, size_t size, double elapsed, double cycles)
+{
+    std::cout << std::fixed << std::setprecision(1) << "stage " << std::left << std::setw(10) << stage
+        << std::setw(8) << profile << std::right << std::setw(9) << size / 1024 << " KB\t"
+        << std::setw(9) << elapsed << " ms\t" << std::setw(9) << (double(size) / ONE_MEGABYTE) / (elapsed / 1000) << " MB/s\t";
+
+    if (BENCHMARK_CYCLES)
+        std::cout << std::setprecision(2) << std::setw(9) << cycles / double(size) << " cyc/B\n";
+    else
+        std::cout << "        - cyc/B\n";
+}
+
+/*
+ * This function times every stage of a cube on its own, for each data profile and input
+ * size, one thread, the way encodeCube and decodeCube call them, on the cube each size
+ * gets (see cubeSideFor). Each stage's input is the output of the one before, and the
+ * decode side has to give back what went in.
+ *
+ * @param key                       key bytes
+ *
+ * @return                          true if every input decoded back to itself
+ */
+bool benchmarkStages(const std::vector<uint8_t>& key)
+{
+    KeySchedule schedule;
+    buildKeySchedule(key, schedule);
+
+    ThreadPool pool(1);
+    CubeArena arena, whole;
+    std::vector<FILE_BUFFER_TYPE>& cube = arena.cube;
+    std::vector<FILE_BUFFER_TYPE>& plain = arena.plain;
+    std::vector<uint8_t> decoded(TWELVE_MEGABYTES);
+    std::vector<FILE_BUFFER_TYPE> gathered;
+
+    const std::string outputFile = "benchmark_stage.khn";
+    const size_t sizes[] = { 1024, 64 * 1024, ONE_MEGABYTE, TWELVE_MEGABYTES };
+    std::mt19937 gen(2025);
+    bool ok = true;
+
+    for (const std::string profile : { "zeros", "text", "binary", "noise" })
+    {
+        for (size_t size : sizes)
+        {
+            std::vector<uint8_t> input = makeProfile(profile, size, gen);
+            double elapsed, cycles;
+
+            uint32_t side = cubeSideFor(size);
+            cube.resize(size_t(side) * side * side);
+            plain.resize(cube.size());
+            gathered.resize(cube.size());
+
+            elapsed = timeStage([&]() { std::copy(input.begin(), input.end(), plain.begin()); XORFileAndKey(plain.data(), size, schedule); }, cycles);
+            printStage("xor", profile, size, elapsed, cycles);
+
+            // what huffmanEncode does before it packs anything, count the bytes and build the codes
+            std::array<uint8_t, 256> lengths;
+            elapsed = timeStage([&]()
+            {
+                std::array<uint32_t, 256> freq = { 0 };
+                for (size_t i = 0; i < size; i++)
+                    freq[plain[i]]++;
+
+                std::array<HuffmanCode, 256> table;
+                buildCodeLengths(freq, lengths);
+                buildCanonicalCodes(lengths, table);
+            }, cycles);
+            printStage("tree", profile, size, elapsed, cycles);
+
+            // the fused pass encodeCube uses instead, XOR and count together, has to count the same
+            std::vector<std::array<uint32_t, 256>> streamFreq(HUFFMAN_STREAMS), plainFreq;
+            std::vector<uint8_t> noHeader;
+            elapsed = timeStage([&]() { XORFileAndKey(noHeader, input.data(), size, plain.data(), schedule, streamFreq, plainFreq, pool); }, cycles);
+            printStage("xor+count", profile, size, elapsed, cycles);
+
+            std::array<uint32_t, 256> staged = { 0 }, fused = { 0 }, stagedPlain = { 0 }, fusedPlain = { 0 };
+            countBytes(plain.data(), size, staged);
+            countBytes(input.data(), size, stagedPlain);
+            for (size_t stream = 0; stream < streamFreq.size(); stream++)
+                for (size_t i = 0; i < fused.size(); i++)
+                {
+                    fused[i] += streamFreq[stream][i];
+                    fusedPlain[i] += plainFreq[stream][i];
+                }
+
+            // anything that was close to random before the XOR is stored rather than encoded
+            size_t encodedSize = 0;
+            bool stored = incompressible(plainFreq);
+            std::vector<uint32_t> streamBits(HUFFMAN_STREAMS);
+            elapsed = timeStage([&]() { huffmanEncode(plain.data(), size, lengths, cube.data(), cube.size() - META_DATA_SIZE, encodedSize, streamBits, stored, pool); }, cycles);
+            printStage(stored ? "stored" : "huffman", profile, size, elapsed, cycles);
+
+            // and the whole cube has to say so, text, zeros and binary always get a Huffman container
+            MappedFile mapped;
+            mapped.wrap(input.data(), size);
+            bool containerMatches = (encodeCube(noHeader, mapped, 0, size, 0, 0, schedule, whole, pool, false, false) == CubeStatus::OK);
+            if (containerMatches)
+            {
+                size_t meta = whole.cube.size() - META_DATA_SIZE;
+                gatherDecode(whole.cube.data(), whole.plain, uint32_t(meta), uint32_t(whole.cube.size()), schedule.shifts, schedule.prime, pool);
+
+                uint32_t lengthAndVersion = 0;
+                for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+                    lengthAndVersion |= uint32_t(whole.plain[meta + STRING_LENGTH_OFFSET + j]) << (j * 8);
+
+                bool storedContainer = (uint8_t(lengthAndVersion >> VERSION_SHIFT) == CONTAINER_STORED);
+                containerMatches = (storedContainer == stored) && (!stored || (profile == "noise"));
+            }
+
+            elapsed = timeStage([&]() { addPadding(cube, uint32_t(encodedSize), 0, 0); }, cycles);
+            printStage("padding", profile, size, elapsed, cycles);
+
+            // shifted once per run, so it's undone as many times below
+            elapsed = timeStage([&]() { rubixEncode(cube, plain, schedule.shifts, pool); }, cycles);
+            printStage("rubix", profile, size, elapsed, cycles);
+
+            elapsed = timeStage([&]() { shuffleEncode(cube.data(), plain, schedule.prime, pool); }, cycles);
+            printStage("shuffle", profile, size, elapsed, cycles);
+
+            elapsed = timeStage([&]()
+            {
+                OutputFile output;
+                output.open(outputFile, plain.size(), false);
+                output.write(plain.data(), plain.size());
+                output.close();
+            }, cycles);
+            printStage("write", profile, size, elapsed, cycles);
+
+            // the gather decodeCube uses, just the Huffman bytes, has to match the first shift undone below
+            elapsed = timeStage([&]() { gatherDecode(plain.data(), gathered, 0, uint32_t(encodedSize), schedule.shifts, schedule.prime, pool); }, cycles);
+            printStage("gather", profile, size, elapsed, cycles);
+
+            // and back again
+            bool gatherMatches = false;
+            shuffleDecode(plain.data(), cube, schedule.prime, pool);
+            for (int run = 0; run < BENCHMARK_RUNS; run++)
+            {
+                rubixDecode(cube, plain, schedule.shifts, pool);
+                if (run == 0)
+                    gatherMatches = std::equal(cube.begin(), cube.begin() + encodedSize, gathered.begin());
+            }
+
+            HuffmanTree tree;
+            bool matches = stored || buildCanonicalTree(lengths, tree);
+            elapsed = timeStage([&]()
+            {
+                if (stored)
+                    std::copy(cube.begin(), cube.begin() + encodedSize, decoded.begin());
+                else
+                    matches = huffmanDecodeStreams(tree, uint32_t(size), cube.data(), encodedSize, streamBits, decoded.data(), decoded.size(), pool);
+            }, cycles);
+            printStage(stored ? "unstored" : "unhuffman", profile, size, elapsed, cycles);
+
+            XORFileAndKey(decoded.data(), size, schedule);
+            matches = matches && std::equal(input.begin(), input.end(), decoded.begin()) && (staged == fused) && (stagedPlain == fusedPlain) && gatherMatches && containerMatches;
+            if (!matches)
+                std::cout << "stage " << profile << ' ' << size << " MISMATCH\n";
+
+            ok = ok && matches;
+        }
+    }
+
+    std::remove(outputFile.c_str());
+
+    // a cube of a size we never write has to come back as an error, not stop the process
+    std::vector<FILE_BUFFER_TYPE> odd(1000), oddScratch(odd.size());
+    MappedFile mapped;
+    mapped.wrap(odd.data(), odd.size());
+    size_t decodedSize = 0;
+    bool rejected = (rubixEncode(odd, oddScratch, schedule.shifts, pool) == false)
+        && (shuffleDecode(odd.data(), oddScratch, schedule.prime, pool) == false)
+        && (decodeCube(mapped, 0, 10, schedule, arena, decodedSize, pool, false, false) == CubeStatus::BAD_CUBE_SIZE);
+    if (!rejected)
+        std::cout << "stage bad cube size MISMATCH\n";
+
+    return ok && rejected;
+}
+
+/*
+ * This function is the entry point for the benchmark.
+ *
+ * @param   argc                    number of command line parameters
+ * @param   argv                    sections to run, all of them if there aren't any
+ * @return  int                     0 if every stage matched its reference, 1 otherwise
+ */
+int main(int argc, char** argv)
+{
+    auto run = [&](const char* section)
+    {
+        if (argc < 2)
+            return true;
+
+        for (int i = 1; i < argc; i++)
+            if (std::strcmp(argv[i], section) == 0)
+                return true;
+
+        return false;
+    };
+
+    std::mt19937 gen(2024);
+    std::uniform_int_distribution<> distrib(0, 0xff);
+
+    std::vector<uint8_t> key(MAX_KEY_SIZE);
+    for (uint8_t& k : key)
+        k = uint8_t(distrib(gen));
+
+    std::vector<FILE_BUFFER_TYPE> cube(SIXTEEN_MEGABYTES);
+    for (FILE_BUFFER_TYPE& c : cube)
+        c = FILE_BUFFER_TYPE(distrib(gen));
+
+    bool ok = true;
+    if (run("shuffle"))
+        ok = benchmarkShuffle(cube, getPrime(key[59])) && ok;
+    if (run("xor"))
+        ok = benchmarkXor(key, gen) && ok;
+    if (run("threads"))
+        ok = benchmarkThreads(cube, key) && ok;
+    if (run("stream"))
+        ok = benchmarkStream(key, gen) && ok;
+    if (run("padding"))
+        ok = benchmarkPadding() && ok;
+    if (run("stages"))
+        ok = benchmarkStages(key) && ok;
+
+    return ok ? 0 : 1;
+}
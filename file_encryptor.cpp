@@ -1,7 +1,13 @@
 // fileEncryptor.cpp : This file contains the 'main' function. Program execution begins and ends there.
 
 #include "file_encryptor.h"
+#include "batch.h"
 #include "huffman.h"
+#include "key_schedule.h"
+#include "metrics.h"
+#include "padding.h"
+#include "rubix.h"
+#include "xor_kernel.h"
 
 
 
@@ -10,27 +16,44 @@
  * name of the input file; we read everything in as binary. If the file can't be opened, return
  * false. After we read in the file, we verify it's at least 64 bytes. We then resize the buffer
  * to 1000 bytes, truncating the key if it's too long. If it's too short, we pad it with 'random'
- * data from the PI constant defined in the header.
+ * data from the PI constant defined in the header. Then everything the stages need from the
+ * key is worked out, see buildKeySchedule.
  *
  * @param   inputFile               name of the file to read in
- * @param   key                     buffer to hold the key
+ * @param   schedule                key tables to fill in
  * @return  boolean
 */
-bool getKey(std::string inputFile, std::vector<uint8_t>& keyFileBuffer)
+bool getKey(std::string inputFile, KeySchedule& schedule)
 {
+    std::vector<uint8_t> keyFileBuffer;
     if (readFile(inputFile, keyFileBuffer, MIN_KEY_SIZE, INT_FAST32_MAX) == false)
     {
         std::cerr << "Error with key file." << std::endl;
         return false;
     }
 
-    int keySize = static_cast<int>(keyFileBuffer.size());
-    keyFileBuffer.resize(MAX_KEY_SIZE, 0);
+    return buildKeySchedule(keyFileBuffer, schedule);
+}
+
+/*
+ * This function does the truncating or padding for getKey, on a key that's already in
+ * memory.
+ *
+ * @param   key                     the key, made MAX_KEY_SIZE bytes here
+ * @return  boolean                 false if the key is shorter than MIN_KEY_SIZE
+*/
+bool prepareKey(std::vector<uint8_t>& key)
+{
+    if (key.size() < MIN_KEY_SIZE)
+        return false;
+
+    int keySize = static_cast<int>(std::min<size_t>(key.size(), MAX_KEY_SIZE));
+    key.resize(MAX_KEY_SIZE, 0);
 
     if (keySize < MAX_KEY_SIZE)
     {
-        uint8_t start = ((keyFileBuffer[HIGHBYTE % keySize] * 10) + keyFileBuffer[LOWBYTE] % keySize);
-        std::copy(PI + start, PI + start + (MAX_KEY_SIZE - keySize), keyFileBuffer.begin() + keySize);
+        uint8_t start = ((key[HIGHBYTE % keySize] * 10) + key[LOWBYTE] % keySize);
+        std::copy(PI + start, PI + start + (MAX_KEY_SIZE - keySize), key.begin() + keySize);
     }
 
     return true;
@@ -43,10 +66,11 @@ bool getKey(std::string inputFile, std::vector<uint8_t>& keyFileBuffer)
  * @param   argc                    number of command line parameters directly from main
  * @param   argv                    the command line parameters directly from main
  * @param   commandLineOptions      this is the map, passed in by reference to populate
+ * @param   inputFiles              every name given after -f
  * @return  boolean                 if we have any issue parsing the command line options
  *                                      return false, otherwise return true;
 */
-bool parseOptions(int argc, char** argv, std::map<std::string, std::string>& commandLineOptions)
+bool parseOptions(int argc, char** argv, std::map<std::string, std::string>& commandLineOptions, std::vector<std::string>& inputFiles)
 {
     for (int i = 1; i < argc; i++)
     {
@@ -72,6 +96,52 @@ bool parseOptions(int argc, char** argv, std::map<std::string, std::string>& com
             }
         }
         else if (input == "-f")
+        {
+            /*
+             * every name up to the next option is a file, wildcard or directory, so a
+             * wildcard the shell has already expanded still works
+             */
+            auto isName = [](std::string name)
+            {
+                std::transform(name.begin(), name.end(), name.begin(),
+                    [](unsigned char c) { return std::tolower(c); }
+                );
+                return !name.empty() && (name[0] != '-') && (name != "decode");
+            };
+
+            if ((i + 1 >= argc) || !isName(argv[i + 1]))
+                return false;
+
+            while ((i + 1 < argc) && isName(argv[i + 1]))
+                inputFiles.push_back(argv[++i]);
+        }
+        else if (input == "-o")
+        {
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            else
+            {
+                commandLineOptions["outputDir"] = argv[i + 1];
+            }
+        }
+        else if (input == "-r")
+            commandLineOptions["recursive"] = "true";
+        else if (input == "--threads")
+        {
+            if (i + 1 >= argc)
+            {
+                return false;
+            }
+            else
+            {
+                commandLineOptions["threads"] = argv[i + 1];
+            }
+        }
+        else if (input == "--direct")
+            commandLineOptions["direct"] = "true";
+        else if (input == "--deterministic-seed")
         {
             if (i + 1 >= argc)
             {
@@ -79,9 +149,17 @@ bool parseOptions(int argc, char** argv, std::map<std::string, std::string>& com
             }
             else
             {
-                commandLineOptions["encryptFile"] = argv[i + 1];
+                commandLineOptions["seed"] = argv[i + 1];
             }
         }
+        else if ((input == "--metrics=json") || (input == "--metrics=json,perf"))
+            commandLineOptions["metrics"] = input.substr(input.find('=') + 1);
+        else if (input.rfind("--metrics", 0) == 0)
+            return false;
+        else if ((input == "--existing=ask") || (input == "--existing=overwrite") || (input == "--existing=skip") || (input == "--existing=fail"))
+            commandLineOptions["existing"] = input.substr(input.find('=') + 1);
+        else if (input.rfind("--existing", 0) == 0)
+            return false;
         else if (input == "-v")
             commandLineOptions["verbose"] = "true";
         else if (input == "decode")
@@ -94,7 +172,36 @@ bool parseOptions(int argc, char** argv, std::map<std::string, std::string>& com
     if (commandLineOptions.find("verbose") == commandLineOptions.end())
         commandLineOptions["verbose"] = "false";
 
-    return true;
+    if (commandLineOptions.find("direct") == commandLineOptions.end())
+        commandLineOptions["direct"] = "false";
+
+    if (commandLineOptions.find("recursive") == commandLineOptions.end())
+        commandLineOptions["recursive"] = "false";
+
+    if (commandLineOptions.find("threads") == commandLineOptions.end())
+        commandLineOptions["threads"] = "1";
+
+    // thread count has to be a plain number between 1 and MAX_THREADS
+    const std::string& threads = commandLineOptions["threads"];
+    if (threads.empty() || threads.size() > 3
+        || std::all_of(threads.begin(), threads.end(), [](unsigned char c) { return std::isdigit(c); }) == false
+        || std::stoul(threads) < 1 || std::stoul(threads) > MAX_THREADS)
+    {
+        return false;
+    }
+
+    // the seed is optional, but if it's there it has to be a plain number
+    if (commandLineOptions.find("seed") != commandLineOptions.end())
+    {
+        const std::string& seed = commandLineOptions["seed"];
+        if (seed.empty() || seed.size() > 19
+            || std::all_of(seed.begin(), seed.end(), [](unsigned char c) { return std::isdigit(c); }) == false)
+        {
+            return false;
+        }
+    }
+
+    return !inputFiles.empty();
 }
 
 #ifdef DEBUG
@@ -120,8 +227,8 @@ void printMatrix(std::string remark, std::vector<FILE_BUFFER_TYPE>& matrix3d)
         for (uint16_t j = 0; j < RUBIX_SIDE_SIZE; j++)
         {
             for (uint16_t k = 0; k < RUBIX_SIDE_SIZE; k++)
-                std::cout << std::hex << std::setw(8) << std::setfill('0')
-                    << FILE_BUFFER_TYPE((*p)[i][j][k]) << " ";
+                std::cout << std::hex << std::setw(2) << std::setfill('0')
+                    << uint32_t((*p)[i][j][k]) << " ";
             std::cout << std::endl;
         }
         std::cout << std::endl;
@@ -184,391 +291,1039 @@ bool readFile(std::string inputFile, std::vector<uint8_t>& inputFileBuffer, uint
 }
 
 /*
- * This function finds a prime number for the final shuffle. In the event the prime
- * number is a factor of the maximum file size, we'll keep increasing until we find a 
- * suitable value.
+ * This function adds random values to the buffer. Random values adds another layer
+ * of security as it hides the length of encoded bytes. They come from ChaCha20 in
+ * bulk, see padding.cpp.
  * 
+ * @param vec                       std::vector buffer to pad, the whole cube
+ * @param pos                       start postion for adding random values
+ * @param stream                    key stream of the file, see reservePaddingStreams
+ * @param cube                      which cube of the file this is
+ *
+ * @return                          void
+*/
+void addPadding(std::vector<FILE_BUFFER_TYPE>& vec, uint32_t pos, uint64_t stream, uint64_t cube)
+{
+    if (pos < vec.size() - META_DATA_SIZE)
+        fillPadding(vec.data() + pos, vec.size() - META_DATA_SIZE - pos, stream, cube * PADDING_BLOCKS_PER_CUBE);
+}
+
+/*
+ * This function picks the smallest cube in CUBE_SIDES with room for the payload ahead
+ * of the metadata. A 2K file gets a 4K cube rather than 16MB of padding.
  *
- * @param index                     start at the specified value from the key
+ * @param payloadSize               number of bytes that have to go in front of the metadata
  *
- * @return                          prime number not a factor of maximum file size
+ * @return                          cube side, RUBIX_SIDE_SIZE if it's too big for any of them
  */
-uint32_t getPrime(uint8_t index)
+uint32_t cubeSideFor(size_t payloadSize)
 {
-    while (SIXTEEN_MEGABYTES % primes[index] == 0)
-        index++;
+    for (uint32_t side : CUBE_SIDES)
+        if (payloadSize <= (size_t(side) * side * side) - META_DATA_SIZE)
+            return side;
 
-    return primes[index];
+    return RUBIX_SIDE_SIZE;
 }
 
 /*
- * This function adds random values to the buffer. Random values adds another layer
- * of security as it hides the length of encoded bytes.
- * 
- * @param vec                       std::vector buffer to pad
- * @param pos                       start postion for adding random values
+ * This function works out which cube a .khn of the given size holds.
+ *
+ * @param cubeSize                  size of the encoded file
+ *
+ * @return                          cube side, 0 if it isn't the size of any of CUBE_SIDES
+ */
+uint32_t cubeSideOf(uint64_t cubeSize)
+{
+    for (uint32_t side : CUBE_SIDES)
+        if (cubeSize == uint64_t(side) * side * side)
+            return side;
+
+    return 0;
+}
+
+/*
+ * This function swaps the extension of the file name for ours, or adds ours if there
+ * isn't one.
+ *
+ * @param fileName                  name of the file we're encoding
+ *
+ * @return                          name of the encoded file
+ */
+std::string getOutputFilename(std::string fileName)
+{
+    std::string::size_type dotLocation = fileName.rfind('.');
+    if (dotLocation == std::string::npos)
+        fileName += '.';
+    else
+        fileName.resize(dotLocation + 1);
+
+    return fileName + FILE_EXTENSION;
+}
+
+/*
+ * This function works out where an output file goes. With no output directory the
+ * name is used as it is. Otherwise the file goes in the output directory under just
+ * its own name, and the directory is made if it isn't there yet.
+ *
+ * @param options                   options for this file, see JobOptions
+ * @param fileName                  name of the output file
+ *
+ * @return                          path to write the output file to
+ */
+std::string getOutputPath(const JobOptions& options, std::string fileName)
+{
+    if (options.outputDir.empty())
+        return fileName;
+
+    std::filesystem::path directory(options.outputDir);
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    return (directory / std::filesystem::path(fileName).filename()).string();
+}
+
+/*
+ * This function builds the header that goes in front of the file, so we know what to
+ * call it and how big it is when we decode it.
+ *
+ * A file that fits in one cube gets 3 bytes for the size of the file. I forgot my
+ * reasoning on why the byte order is like this, we only 3 bytes be cause 12MB < 2^32.
+ * Then the file name so we can extract it later.
+ *
+ * A streamed file gets STREAMED_FILE_MARKER in place of the 3 byte file size, the file
+ * name like a single cube, then the real file size in 8 bytes. It goes in front of the
+ * first block only.
+ *
+ * @param fileName                  name to store, up to 255 bytes of it
+ * @param fileSize                  size of the whole file
+ * @param header                    the header, filled in here
  *
  * @return                          void
-*/
-void addPadding(std::vector<uint32_t>& vec, uint32_t pos)
+ */
+void buildHeader(const std::string& fileName, uint64_t fileSize, std::vector<uint8_t>& header)
 {
-    std::random_device rd;  // a seed source for the random number engine
-    std::mt19937 gen(rd()); // mersenne_twister_engine seeded with rd()
-    std::uniform_int_distribution<> distrib(0, 0xff);
+    bool streamed = (fileSize > TWELVE_MEGABYTES);
+    uint32_t sizeField = streamed ? STREAMED_FILE_MARKER : static_cast<uint32_t>(fileSize);
+    size_t nameLength = std::min<size_t>(fileName.size(), UINT8_MAX);
+
+    header.clear();
+    for (int i = 2; i >= 0; i--)
+        header.push_back((sizeField >> (i * 8)) & 0xff);
 
-    for (uint32_t i = pos; i < SIXTEEN_MEGABYTES - META_DATA_SIZE; i++)
-        vec[i] = distrib(gen);
+    header.push_back(uint8_t(nameLength));
+    header.insert(header.end(), fileName.begin(), fileName.begin() + nameLength);
+
+    if (streamed)
+        for (int i = 7; i >= 0; i--)
+            header.push_back(uint8_t(fileSize >> (i * 8)));
 }
 
 /*
- * This is the main driver for encoding the file. We parse out the filename before
- * we do anything so we know what to call it later when we write the output file.
- * Per instructions, XOR the buffer against the key in 1000 chunks, followed by
- * Huffman encoding to break the byte boundry (defined in huffman.cpp).  Since we
- * have 4MB buffer to play with, we'll keep the length of the huffman encoded string
- * as well as the frequency map, which we'll need to decode this stuff. Then we do
- * our Rubix shuffle before writing the output file.
- * 
- * @param fileBuffer                std::vector buffer to encode
- * @param key                       key we'll use to shuffle the rubix array around
- * @param verbose                   boolean to track whether we want output messages
- * 
- * @return                          false, if for some reason we have an issue
- *                                  true otherwise
+ * This function reads the header back off the front of a decoded cube, see buildHeader.
+ * For a single cube, the whole file has to be there after it.
+ *
+ * @param bytes                     the decoded cube
+ * @param count                     number of decoded bytes
+ * @param header                    what the header says, filled in here
+ *
+ * @return                          false if it can't be a header we wrote
  */
-bool encode(std::vector<uint8_t>& fileBuffer, std::vector<uint8_t>& key, bool verbose)
+bool readHeader(const uint8_t* bytes, size_t count, FileHeader& header)
 {
-    uint8_t fileNameLength = fileBuffer[3];
+    if (count < 4)
+        return false;
+
+    // read 3 bytes for the size of the file.
+    uint32_t sizeField = 0;
+    for (int i = 2; i >= 0; i--)
+        sizeField |= uint32_t(bytes[i]) << ((2 - i) * 8);
+
+    uint8_t fileNameLength = bytes[3];
+    header.streamed = (sizeField == STREAMED_FILE_MARKER);
+    header.size = size_t(4) + fileNameLength + (header.streamed ? 8 : 0);
+
+    if (count < header.size)
+        return false;
 
     // read the file name from the buffer
-    std::string outputFilename(fileBuffer.begin() + 4, fileBuffer.begin() + 4 + fileNameLength);
+    header.fileName.assign(bytes + 4, bytes + 4 + fileNameLength);
 
-    // Remove the extension from the filename
-    std::string::size_type dotLocation = outputFilename.rfind('.');
-    if (dotLocation == std::string::npos)
+    header.fileSize = sizeField;
+    if (header.streamed)
     {
-        outputFilename += '.';
-        dotLocation = outputFilename.size();
+        header.fileSize = 0;
+        for (size_t i = 4 + fileNameLength; i < header.size; i++)
+            header.fileSize = (header.fileSize << 8) | bytes[i];
+
+        return true;
     }
-    else
-        outputFilename.resize(dotLocation + 1);
 
-    outputFilename += FILE_EXTENSION;
+    return count >= header.size + header.fileSize;
+}
+
+/*
+ * This function turns what went wrong with a cube into something to tell the user.
+ *
+ * @param status                    what encodeCube or decodeCube returned
+ *
+ * @return                          message to print
+ */
+const char* cubeStatusMessage(CubeStatus status)
+{
+    switch (status)
+    {
+        case CubeStatus::OK:                return "OK.";
+        case CubeStatus::BAD_HEADER:        return "Error with file header.";
+        case CubeStatus::HUFFMAN_ERROR:     return "Error with huffman encoding";
+        case CubeStatus::UNKNOWN_VERSION:   return "Unknown file version.";
+        case CubeStatus::BAD_CUBE_SIZE:     return "Not a cube size we encode.";
+    }
+
+    return "Unknown error.";
+}
+
+/*
+ * This function encodes one cube. Per instructions, XOR the buffer against the key in
+ * 1000 chunks, followed by Huffman encoding to break the byte boundry (defined in
+ * huffman.cpp), unless the file's bytes are already too close to random for that to
+ * save anything (judged before the XOR, see incompressible) and are stored as they are.
+ * Since we have 4MB buffer to play with, we'll keep the length of the huffman encoded
+ * string as well as the code lengths, which we'll need to decode this stuff. Then we
+ * do our Rubix shift and final shuffle.
+ *
+ * The file itself is never copied as is, the XOR reads it straight out of the mapping
+ * and writes our working buffer, header first.
+ *
+ * The cube is as small as the Huffman bytes let it be, unless we're told its side.
+ * Huffman coding goes into the cube the plain bytes would need, or the next size up if
+ * it comes out bigger, then the cube is cut down to the smallest that holds the result.
+ *
+ * Memory: every stage works in the arena's two buffers, which are only allocated if
+ * they've never been this big, see CubeArena. The part of the mapping we read is
+ * handed back as soon as it's XORed.
+ *
+ * @param header                    file size and name, goes in front of the file
+ * @param input                     mapped input file
+ * @param offset                    where in the input this cube's bytes start
+ * @param length                    number of bytes of input in this cube, up to 12MB
+ * @param side                      cube side, one of CUBE_SIDES, or 0 for the smallest
+ *                                  that holds the encoded bytes
+ * @param paddingStream             key stream for the file's padding, see reservePaddingStreams
+ * @param schedule                  key tables, worked out once for every file
+ * @param arena                     buffers to work in, the encoded cube ends up in arena.cube
+ * @param pool                      threads for Huffman encoding, the Rubix shift and final shuffle
+ * @param verbose                   boolean to track whether we want output messages
+ * @param showStages                report each stage, off when we're one block of many
+ *
+ * @return                          OK, or what went wrong, see cubeStatusMessage
+ */
+CubeStatus encodeCube(const std::vector<uint8_t>& header, const MappedFile& input, uint64_t offset, size_t length, uint32_t side, uint64_t paddingStream, const KeySchedule& schedule, CubeArena& arena, ThreadPool& pool, bool verbose, bool showStages)
+{
+    // stage progress, only when we're the whole file rather than one block
+    auto stage = [&](uint8_t next)
+    {
+        if (showStages == false)
+            return;
+
+        update(verbose, next);
+    };
+
+    // a cube on a pool of its own is one of many running at once, so it's timed on its own thread
+    StageTimer metrics(true, pool.size() > 1);
+
+    stage(ENCODE_XOR);
+
+    std::vector<FILE_BUFFER_TYPE>& rubix = arena.cube;
+    std::vector<FILE_BUFFER_TYPE>& plain = arena.plain;
 
-    update(verbose, ENCODE_XOR);
+    size_t plainSize = header.size() + length;
+    bool scaled = (side == 0);
+    if (scaled)
+        side = cubeSideFor(plainSize);
+    else if (cubeSideOf(uint64_t(side) * side * side) != side)
+        return CubeStatus::BAD_CUBE_SIZE;
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    if (plainSize > (size_t(side) * side * side) - META_DATA_SIZE)
+        return CubeStatus::BAD_HEADER;
+
+    rubix.resize(size_t(side) * side * side);
+    plain.resize(rubix.size());
 
     /*
-     * XOR the key against the array in 1K chunks (run down the full array)
+     * XOR the key against the array in 1K chunks (run down the full array), counting the
+     * bytes for Huffman on the way, before and after the XOR, unless we've been asked for
+     * a pass each
      */
-    XORFileAndKey(fileBuffer, key);
+    std::vector<std::array<uint32_t, 256>> streamFreq(HUFFMAN_STREAMS);
+    std::vector<std::array<uint32_t, 256>> plainFreq(1);
+    metrics.start(ENCODE_XOR, length);
+    if (schedule.fusedCount)
+        XORFileAndKey(header, input.data() + offset, length, plain.data(), schedule, streamFreq, plainFreq, pool);
+    else
+        XORFileAndKey(header, input.data() + offset, length, plain.data(), schedule);
+    metrics.stop(plainSize);
+
+    stage(ENCODE_HUFFMAN);
+    metrics.start(ENCODE_HUFFMAN, plainSize);
 
-    update(verbose, ENCODE_HUFFMAN);
+    // a pass each, the bytes before the XOR are counted here, like Huffman counts the ones after
+    if (schedule.fusedCount == false)
+    {
+        plainFreq[0].fill(0);
+        countBytes(header.data(), header.size(), plainFreq[0]);
+        countBytes(input.data() + offset, length, plainFreq[0]);
+    }
+    input.release(offset, length);
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    // whether to store is up to the bytes before the XOR, see incompressible
+    bool stored = incompressible(plainFreq);
 
     /*
      * Perform Huffman encoding of resulting array, creating array
      */
-    std::array<uint32_t, 256> freq = { 0 };
-    std::vector<uint8_t> encodedBytes;
-    uint32_t stringLength = 0;
-    if (huffmanEncode(fileBuffer, freq, encodedBytes, stringLength) == false)
+    /*
+     * Huffman encode straight into the Rubix array, or copy the bytes across as they
+     * are if they're too close to random for Huffman to do anything with
+     */
+    std::array<uint8_t, 256> lengths = { 0 };
+    std::vector<uint32_t> streamBits(HUFFMAN_STREAMS);
+    uint32_t symbolCount = static_cast<uint32_t>(plainSize);
+    size_t encodedSize = 0;
+    bool encoded = false;
+
+    for (;;)
     {
-        std::cerr << "Error with huffman encoding" << std::endl;
-        exit(1);
+        encoded = schedule.fusedCount
+            ? huffmanEncode(plain.data(), plainSize, streamFreq, lengths, rubix.data(), rubix.size() - META_DATA_SIZE, encodedSize, streamBits, stored, pool)
+            : huffmanEncode(plain.data(), plainSize, lengths, rubix.data(), rubix.size() - META_DATA_SIZE, encodedSize, streamBits, stored, pool);
+
+        if (encoded || !scaled || (side == RUBIX_SIDE_SIZE))
+            break;
+
+        // Huffman made it bigger than the plain bytes, try the next cube up
+        side *= 2;
+        rubix.resize(size_t(side) * side * side);
+        plain.resize(rubix.size());
+    }
+
+    if (encoded == false)
+    {
+        return CubeStatus::HUFFMAN_ERROR;
     }
 
-    update(verbose, ENCODE_RUBIX);
+    // and the other way, what's left may fit a smaller cube, the plain bytes aren't needed any more
+    if (scaled && (cubeSideFor(encodedSize) < side))
+    {
+        side = cubeSideFor(encodedSize);
+        rubix.resize(size_t(side) * side * side);
+        plain.resize(rubix.size());
+    }
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    uint32_t meta = uint32_t(rubix.size() - META_DATA_SIZE);
 
-    /*
-     * Load array' into the Rubix array
-     */
-    std::vector<uint32_t> rubix = { 0 };
-    std::copy(encodedBytes.begin(), encodedBytes.end(), std::back_inserter(rubix));
-    rubix.erase(rubix.begin());
+    uint32_t stringLength = static_cast<uint32_t>(encodedSize * 8);
+    metrics.stop(encodedSize);
+
+    stage(ENCODE_RUBIX);
+    metrics.start(ENCODE_RUBIX, encodedSize);
+
+    // the arena has the last cube's bytes in it, the metadata starts at zero and the padding covers the rest
+    std::fill(rubix.begin() + meta, rubix.end(), FILE_BUFFER_TYPE(0));
 
     /*
-     * Let's clear these vectors since we don't need them anymore.
-     * They'll probably be cleaned up with the garbage collection, but we're
-     * now using 64 MB of memory and these are unnecessary.
+     * we need to keep the code lengths and how many bytes we encoded to huffman decode,
+     * since we're not using the last 4 megabytes, we'll just stick them in the metadata
      */
-    encodedBytes.clear();
-    fileBuffer.clear();
+    for (uint16_t i = 0; i < lengths.size(); i++)
+        rubix[meta + CODE_LENGTHS_OFFSET + i] = lengths[i];
 
-    rubix.resize(SIXTEEN_MEGABYTES);
+    for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+        rubix[meta + SYMBOL_COUNT_OFFSET + j] = uint32_t(symbolCount >> (j * 8)) & 0xff;
 
     /*
-     * we need to keep the frequency map to huffman decode, since we're not using the last
-     * 4 megabytes, we'll just stick it there
+     * and where each of the huffman streams ends, so they can be decoded side by side,
+     * stored bytes don't have any streams
      */
-    for (uint16_t i = 0; i < freq.size(); i++)
+    if (!stored)
+    {
         for (uint8_t j = 0; j < sizeof(uint32_t); j++)
-            rubix[SIXTEEN_MEGABYTES - 1024 + (i * 4) + j] = uint32_t(freq[i] >> (j * 8)) & 0xff;
+            rubix[meta + STREAM_COUNT_OFFSET + j] = uint32_t(streamBits.size() >> (j * 8)) & 0xff;
+
+        for (size_t i = 0; i < streamBits.size(); i++)
+            for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+                rubix[meta + STREAM_BITS_OFFSET + (i * 4) + j] = uint32_t(streamBits[i] >> (j * 8)) & 0xff;
+    }
 
-    addPadding(rubix, stringLength);
+    // padding starts straight after the last Huffman byte, so nothing shows where the bits stop
+    addPadding(rubix, static_cast<uint32_t>(encodedSize), paddingStream, offset / STREAM_BLOCK_SIZE);
 
     /*
      * we also need to keep the length of the huffman encoded string to pass back to the decoder
-     * we'll just stick it right before the frequency map
+     * we'll just stick it right before the code lengths, along with the container version
      */
+    uint32_t lengthAndVersion = stringLength | (uint32_t(stored ? CONTAINER_STORED : CONTAINER_STREAMS) << VERSION_SHIFT);
     for (uint8_t j = 0; j < sizeof(uint32_t); j++)
-        rubix[SIXTEEN_MEGABYTES - META_DATA_SIZE + j] = uint32_t(stringLength >> (j*8)) & 0xff;
+        rubix[meta + STRING_LENGTH_OFFSET + j] = uint32_t(lengthAndVersion >> (j*8)) & 0xff;
 
-    // Cast the buffer to a pointer instead of loading to a separate array
-    FILE_BUFFER_TYPE(*p)[RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE] =
-        reinterpret_cast<FILE_BUFFER_TYPE(*)[RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE]>(rubix.data());
+    /*
+     * 'Rubix' shift array, see rubix.cpp
+     */
+    // the plain bytes are encoded, so that buffer is our scratch cube from here
+    if (rubixEncode(rubix, plain, schedule.shifts, pool) == false)
+        return CubeStatus::BAD_CUBE_SIZE;
+    metrics.stop(rubix.size());
+
+    stage(ENCODE_SHUFFLE);
+    metrics.start(ENCODE_SHUFFLE, rubix.size());
 
     /*
-     * 'Rubix' shift array
+     * This is the final shuffle in the encryption. Every byte moves to a slot picked by a prime
+     * number selected from the primes array and the 59th byte from the key, see rubix.cpp.
      */
-    for (uint16_t z = 0; z < RUBIX_SIDE_SIZE; z++)
-        for (uint16_t y = 0; y < RUBIX_SIDE_SIZE; y++)
-            for (uint16_t x = 0; x < RUBIX_SIDE_SIZE; x++)
-            {
-                uint32_t currentXLocation =((x + key[y]) % RUBIX_SIDE_SIZE);
-                (*p)[z][y][x] |= (currentXLocation << X_OFFSET);
+    if (shuffleEncode(rubix.data(), plain, schedule.prime, pool) == false)
+        return CubeStatus::BAD_CUBE_SIZE;
+    rubix.swap(plain);
+    metrics.stop(rubix.size());
 
-                int16_t xLoc = ((x - key[y]) + RUBIX_SIDE_SIZE) % RUBIX_SIDE_SIZE;
+    return CubeStatus::OK;
+}
 
-                uint32_t currentYLocation = ((y + key[x]) % RUBIX_SIDE_SIZE);
-                (*p)[z][y % RUBIX_SIDE_SIZE][xLoc] |= (currentYLocation << Y_OFFSET);
+/*
+ * This is the main driver for encoding a file that fits in one cube. We put the file
+ * size and name in a header in front of the file so we know what to call it when we
+ * decode it, then encode the cube and write it out.
+ *
+ * Memory: the arena's two buffers, each the size of the cube, see encodeCube.
+ * 
+ * @param inputFile                 name of the file to encode
+ * @param input                     the file, mapped
+ * @param schedule                  key tables, worked out once for every file
+ * @param arena                     buffers to encode in
+ * @param pool                      threads for Huffman encoding, the Rubix shift and final shuffle
+ * @param options                   output directory, O_DIRECT and progress, see JobOptions
+ * 
+ * @return                          false, if for some reason we have an issue
+ *                                  true otherwise
+ */
+bool encode(std::string inputFile, const MappedFile& input, const KeySchedule& schedule, CubeArena& arena, ThreadPool& pool, const JobOptions& options)
+{
+    // progress, unless we're one file of a batch
+    auto stage = [&](uint8_t next)
+    {
+        if (options.quiet)
+            return;
 
-                uint32_t currentZLocation = (((z + key[x]) % RUBIX_SIDE_SIZE));
-                (*p)[z][y][xLoc] |= (currentZLocation << Z_OFFSET);
-            }
+        update(options.verbose, next);
+    };
 
-    std::sort(rubix.begin(), rubix.end());
+    // the file size and name go in front of the file, see buildHeader
+    std::vector<uint8_t> header;
+    buildHeader(inputFile, input.size(), header);
 
-    update(verbose, ENCODE_SHUFFLE);
+    std::string outputFilename = getOutputPath(options, getOutputFilename(inputFile));
+    if (skipExisting(outputFilename, options))
+        return true;
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    input.prefetch(0, input.size());
 
-    /*
-     * This is the final shuffle in the encryption. We put a byte in to an empty slot based on a prime
-     * number selected from the primes array and the 59th byte from the key.
-     */
-    uint32_t prime = getPrime(key[59]);
-    uint32_t counter = 1;
-    for (uint32_t i = 1; i < rubix.size(); i++)
+    CubeStatus status = encodeCube(header, input, 0, size_t(input.size()), 0, options.paddingStream, schedule, arena, pool, options.verbose, !options.quiet);
+    if (status != CubeStatus::OK)
     {
-        rubix[rubix.size() - (i * prime) % rubix.size()] &= 0xff;
-        rubix[rubix.size() - (i * prime) % rubix.size()] |= counter++ << 8;
+        std::cerr << cubeStatusMessage(status) << std::endl;
+        return false;
     }
-    std::sort(rubix.begin(), rubix.end());
 
-    update(verbose, ENCODE_WRITE_OUT);
+    stage(ENCODE_WRITE_OUT);
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    StageTimer metrics(true, false);
+    metrics.start(ENCODE_WRITE_OUT, arena.cube.size());
 
     /*
      * write output file
      */
-    if (writeFile<uint32_t>(outputFilename, rubix) == false)
+    if (writeFile(outputFilename, arena.cube.data(), arena.cube.size(), options.direct, options.existing) == false)
     {
         std::cerr << "Error writing file." << std::endl;
         return false;
     }
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    metrics.stop(arena.cube.size());
 
-    update(verbose, STAGE_END);
+    stage(STAGE_END);
 
     return true;
 }
 
 /*
- * This is the main driver to decode the file. We should be doing the reverse order of
- * the encode function. Start with the Rubix shift. For the huffman decoding, we need 
- * to extract the frequecy map and length of the encoded string. Then, build the encoded
- * string back from the least significant bytes of the Rubix array, then XOR the decoded
- * bytes against the key, followed by writing the output file.
- * 
- * @param fileBuffer                std::vector containing input file to decode
- * @param key                       key we'll use to shuffle the rubix array around
+ * This function decodes one cube, the reverse order of encodeCube. Start with the
+ * final shuffle and the Rubix shift, undone together in one gather of just the bytes
+ * we need. For the huffman decoding, we need to extract the
+ * code lengths (or the frequency map in older files) and length of the encoded string.
+ * Then, decode the Huffman bits straight out of the Rubix array (or just copy the bytes
+ * out, if they were stored) and XOR the decoded bytes against the key.
+ *
+ * Memory: every stage works in the arena's two buffers, which are only allocated if
+ * they've never been this big, see CubeArena. The gather reads the metadata and
+ * Huffman bytes straight out of the mapping into their places in arena.cube, after
+ * that we hand the mapping back. The decoded bytes end up at the front of arena.plain.
+ *
+ * @param input                     mapped input file
+ * @param offset                    where in the input the cube starts
+ * @param side                      cube side, one of CUBE_SIDES, see cubeSideOf
+ * @param schedule                  key tables, worked out once for every file
+ * @param arena                     buffers to work in, the decoded bytes, header and all, end up in arena.plain
+ * @param decodedSize               number of decoded bytes, set here
+ * @param pool                      threads for the final shuffle, Rubix shift and Huffman decoding
  * @param verbose                   boolean to track whether we want output messages
+ * @param showStages                report each stage, off when we're one block of many
  *
- * @return                          false, if for some reason we have an issue
- *                                  true otherwise
+ * @return                          OK, or what went wrong, see cubeStatusMessage
  */
-bool decode(std::vector<uint8_t>& fileBuffer, std::vector<uint8_t>& key, bool verbose)
+CubeStatus decodeCube(const MappedFile& input, uint64_t offset, uint32_t side, const KeySchedule& schedule, CubeArena& arena, size_t& decodedSize, ThreadPool& pool, bool verbose, bool showStages)
 {
-    /*
-     * Load array' into the Rubix array
-     */
-    std::vector<uint32_t> rubix;
-    std::copy(fileBuffer.begin(), fileBuffer.end(), std::back_inserter(rubix));
+    // stage progress, only when we're the whole file rather than one block
+    auto stage = [&](uint8_t next)
+    {
+        if (showStages == false)
+            return;
+
+        update(verbose, next);
+    };
 
     /*
      * 3. Perform steps 9 & 10 to build the Shuffle map
      * 4. Reverse step 11 - move elements from the input array into the Rubix array
      */ 
-    update(verbose, DECODE_SHUFFLE);
+    // a cube on a pool of its own is one of many running at once, so it's timed on its own thread
+    StageTimer metrics(false, pool.size() > 1);
+
+    stage(DECODE_SHUFFLE);
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    std::vector<FILE_BUFFER_TYPE>& rubix = arena.cube;
+    std::vector<FILE_BUFFER_TYPE>& plain = arena.plain;
 
-    uint32_t prime = getPrime(key[59]);
-    uint32_t counter = 1;
-    for (uint32_t i = 1; i < rubix.size(); i++)
-        rubix[counter++] |= (rubix.size() - ((i * prime) % rubix.size())) << 8;
+    // the side comes from the size of what we're handed, only the sizes we write are any good
+    if (cubeSideOf(uint64_t(side) * side * side) != side)
+        return CubeStatus::BAD_CUBE_SIZE;
 
-    std::sort(rubix.begin(), rubix.end());
+    rubix.resize(size_t(side) * side * side);
+    plain.resize(rubix.size());
 
-    update(verbose, DECODE_RUBIX);
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    uint32_t cubeSize = uint32_t(rubix.size());
+    uint32_t meta = cubeSize - META_DATA_SIZE;
 
     /*
-     * 'Rubix' unshuffling, in place
+     * The final shuffle and the 'Rubix' shift are undone together, every byte we need
+     * comes straight out of the mapping from wherever the two put it, see gatherDecode.
+     * The metadata comes first, it tells us how much of the cube is Huffman bytes, then
+     * just those. The padding is never read.
      */
+    metrics.start(DECODE_SHUFFLE, cubeSize);
+    if (gatherDecode(input.data() + offset, rubix, meta, cubeSize, schedule.shifts, schedule.prime, pool) == false)
+        return CubeStatus::BAD_CUBE_SIZE;
 
-    // We, again, cast the buffer to a pointer instead of loading to a separate array
-    FILE_BUFFER_TYPE(*p)[RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE] =
-        reinterpret_cast<FILE_BUFFER_TYPE(*)[RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE][RUBIX_SIDE_SIZE]>(rubix.data());
-
-    for (int16_t z = 0; z < RUBIX_SIDE_SIZE; z++)
-    {
-        for (int16_t y = 0; y < RUBIX_SIDE_SIZE; y++)
-        {
-            for (int16_t x = 0; x < RUBIX_SIDE_SIZE; x++)
-            {
-                (*p)[z][y][x] &= (Z_MASK);
-                int32_t currentZLocation = ((z - key[x]) + RUBIX_SIDE_SIZE) % RUBIX_SIDE_SIZE;
-                (*p)[z][y][x] |= (currentZLocation << Z_OFFSET);
-
-                (*p)[z][y][x] &= (Y_MASK);
-                int32_t currentYLocation = ((y - key[x]) + RUBIX_SIDE_SIZE) % RUBIX_SIDE_SIZE;
-                (*p)[z][y][x] |= (currentYLocation << Y_OFFSET);
-
-                int16_t yLoc = (y + key[x]) % RUBIX_SIDE_SIZE
-                    , zLoc = (z + key[x]) % RUBIX_SIDE_SIZE;
+    // We need to get the length of the huffman encoded string so we know where to stop,
+    // the top bits tell us which container version wrote the rest of the metadata
+    uint32_t stringLength = 0;
+    for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+        stringLength |= uint32_t(rubix[meta + STRING_LENGTH_OFFSET + j]) << (j * 8);
 
-                (*p)[zLoc][yLoc][x] &= X_MASK;
-                int32_t currentXLocation = ((x - key[y]) + RUBIX_SIDE_SIZE) % RUBIX_SIDE_SIZE;
-                (*p)[zLoc][yLoc][x] |= (currentXLocation << X_OFFSET);
-            }
-        }
-    }
+    uint8_t version = uint8_t(stringLength >> VERSION_SHIFT);
+    stringLength &= STRING_LENGTH_MASK;
 
-    std::sort(rubix.begin(), rubix.end());
+    // a length past the metadata is most likely the wrong key, the checks below catch it
+    uint32_t payloadSize = std::min<uint32_t>((stringLength + 7) / 8, meta);
+    if (gatherDecode(input.data() + offset, rubix, 0, payloadSize, schedule.shifts, schedule.prime, pool) == false)
+        return CubeStatus::BAD_CUBE_SIZE;
+    input.release(offset, cubeSize);
+    metrics.stop(uint64_t(payloadSize) + META_DATA_SIZE);
 
     /*
      * 9. Perform Huffman decoding to create array from array (implement last)
      */
-    update(verbose, DECODE_HUFFMAN);
+    stage(DECODE_HUFFMAN);
+    metrics.start(DECODE_HUFFMAN, payloadSize);
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    HuffmanTree tree;
+    uint32_t symbolCount = 0;
 
-    // we need to get the frequency map from the end of the buffer as Huffman can't
-    // recreate it
-    std::array<uint32_t, 256> freq = { 0 };
-    for (int i = 0; i < freq.size(); i++)
+    if (version == CONTAINER_FREQUENCY_MAP)
     {
-        size_t start = rubix.size() - 1024 + (i * 4);
-        for (size_t j = start; j < start + 4; j++)
-            freq[i] |= (rubix[j]&0xff) << ((j % 4) * 8);
-    }
+        // the original format kept the whole frequency map and we rebuild the tree from it
+        std::array<uint32_t, 256> freq = { 0 };
+        uint64_t total = 0;
+        for (uint16_t i = 0; i < freq.size(); i++)
+        {
+            for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+                freq[i] |= uint32_t(rubix[meta + FREQUENCY_MAP_OFFSET + (i * 4) + j]) << (j * 8);
 
-    // We need to get the length of the huffman encoded string so we know how much
-    // to truncate before passing it to the decode function
-    uint32_t stringLength = 0;
-    for (size_t j = rubix.size()-1028; j < rubix.size()-1024; j++)
-        stringLength |= (rubix[j] & 0xff) << ((j % 4) * 8);
+            total += freq[i];
+        }
 
-    // create the Huffman string to decode
-    std::vector<uint8_t> decodedBytes;
-    std::string input;
-    
-    for (uint32_t i : rubix)
-    {
-        input += std::bitset<8>(i&0xff).to_string();
-        if (input.length() >= stringLength)
-            break;
+        if (total > SIXTEEN_MEGABYTES)
+        {
+            return CubeStatus::HUFFMAN_ERROR;
+        }
+
+        buildHuffmanTree(freq, tree);
+        symbolCount = static_cast<uint32_t>(total);
     }
+    else if ((version == CONTAINER_CODE_LENGTHS) || (version == CONTAINER_STREAMS))
+    {
+        std::array<uint8_t, 256> lengths = { 0 };
+        for (uint16_t i = 0; i < lengths.size(); i++)
+            lengths[i] = uint8_t(rubix[meta + CODE_LENGTHS_OFFSET + i]);
+
+        for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+            symbolCount |= uint32_t(rubix[meta + SYMBOL_COUNT_OFFSET + j]) << (j * 8);
 
-    input.resize(stringLength);
+        if (buildCanonicalTree(lengths, tree) == false)
+        {
+            return CubeStatus::HUFFMAN_ERROR;
+        }
+    }
+    else if (version == CONTAINER_STORED)
+    {
+        for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+            symbolCount |= uint32_t(rubix[meta + SYMBOL_COUNT_OFFSET + j]) << (j * 8);
 
+        // the string length is the stored bytes in bits, anything else is most likely the wrong key
+        if ((symbolCount > meta) || (uint64_t(symbolCount) * 8 != stringLength))
+        {
+            return CubeStatus::HUFFMAN_ERROR;
+        }
+    }
+    else
+    {
+        return CubeStatus::UNKNOWN_VERSION;
+    }
 
-    if ( huffmanDecode(input, freq, decodedBytes) ==false)
+    // Huffman bytes can stand for more than the cube holds, the most any cube has is 12MB and the header
+    if (symbolCount > SIXTEEN_MEGABYTES)
     {
-        std::cerr << "Error with huffman encoding" << std::endl;
-        exit(1);
+        return CubeStatus::HUFFMAN_ERROR;
     }
 
-    update(verbose, DECODE_XOR);
+    if (plain.size() < symbolCount)
+        plain.resize(symbolCount);
 
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    // decode straight out of the rubix array
+    bool decoded = false;
 
-    /*
-     * 10. Perform encrypt step 3 (XOR)
-     * XOR the key against the array in 1K chunks (run down the full array)
-     */
-    XORFileAndKey(decodedBytes, key);
+    if (version == CONTAINER_STREAMS)
+    {
+        uint32_t streamCount = 0;
+        for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+            streamCount |= uint32_t(rubix[meta + STREAM_COUNT_OFFSET + j]) << (j * 8);
 
-    /* 
-     * 11. Extract string length and file suffix
-     *      3 bytes for file size
-     *      1 byte for file name length
-     *      file name
-     */
-    update(verbose, DECODE_WRITE_OUT);
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+        // a stream count we can't have written, most likely the wrong key
+        if ((streamCount == 0) || (streamCount > MAX_HUFFMAN_STREAMS))
+        {
+            return CubeStatus::HUFFMAN_ERROR;
+        }
 
-    // read 3 bytes for the size of the file.
-    uint32_t fileSize = 0;
-    for (int i = 2; i >= 0; i--)
-        fileSize |= (decodedBytes[i] << ((2-i)*8));
+        std::vector<uint32_t> streamBits(streamCount);
+        for (size_t i = 0; i < streamBits.size(); i++)
+            for (uint8_t j = 0; j < sizeof(uint32_t); j++)
+                streamBits[i] |= uint32_t(rubix[meta + STREAM_BITS_OFFSET + (i * 4) + j]) << (j * 8);
 
-    uint8_t fileNameLength = decodedBytes[3];
+        decoded = huffmanDecodeStreams(tree, symbolCount, rubix.data(), payloadSize, streamBits, plain.data(), plain.size(), pool);
+    }
+    else if (version == CONTAINER_STORED)
+    {
+        // nothing to decode, the bytes were kept as they are
+        std::copy(rubix.begin(), rubix.begin() + symbolCount, plain.begin());
+        decoded = true;
+    }
+    else
+        decoded = huffmanDecode(tree, symbolCount, rubix.data(), payloadSize, stringLength, plain.data(), plain.size());
 
-    // read the file name from the buffer
-    std::string outputFilename(decodedBytes.begin() + 4, decodedBytes.begin() + 4 + fileNameLength);
+    if (decoded == false)
+    {
+        return CubeStatus::HUFFMAN_ERROR;
+    }
 
-    /*
-     * Erase the 3 byte header and file name from the buffer
-     */
-    decodedBytes.erase(decodedBytes.begin(), decodedBytes.begin() + 4 + fileNameLength);
-    decodedBytes.erase(decodedBytes.begin() + fileSize, decodedBytes.end());
+    metrics.stop(symbolCount);
 
+    stage(DECODE_XOR);
 
     /*
-     * 12. Create output file with correct suffix using string length
+     * 10. Perform encrypt step 3 (XOR)
+     * XOR the key against the array in 1K chunks (run down the full array)
      */
-    if (writeFile<uint8_t>(outputFilename, decodedBytes) == false)
-    {
-        std::cerr << "Error writing file." << std::endl;
-        return false;
-    }
-#if TIMER
-    times.push_back(std::chrono::steady_clock::now());
-#endif
+    decodedSize = symbolCount;
+    metrics.start(DECODE_XOR, decodedSize);
+    XORFileAndKey(plain.data(), decodedSize, schedule);
+    metrics.stop(decodedSize);
 
-    update(verbose, STAGE_END);
-    return true;
+    return CubeStatus::OK;
+}
+
+/*
+ * This is the main driver to decode a file that fits in one cube. We decode the cube,
+ * then pull the file size and name off the front of the decoded bytes and write the
+ * output file.
+ *
+ * Memory: the arena's two buffers, each the size of the cube, see decodeCube.
+ * 
+ * @param input                     the file to decode, mapped
+ * @param schedule                  key tables, worked out once for every file
+ * @param arena                     buffers to decode in
+ * @param pool                      threads for the final shuffle, Rubix shift and Huffman decoding
+ * @param options                   output directory, O_DIRECT and progress, see JobOptions
+ *
+ * @return                          false, if for some reason we have an issue
+ *                                  true otherwise
+ */
+bool decode(const MappedFile& input, const KeySchedule& schedule, CubeArena& arena, ThreadPool& pool, const JobOptions& options)
+{
+    // progress, unless we're one file of a batch
+    auto stage = [&](uint8_t next)
+    {
+        if (options.quiet)
+            return;
+
+        update(options.verbose, next);
+    };
+
+    // the size of the file tells us the size of the cube
+    uint32_t side = cubeSideOf(input.size());
+    if (side == 0)
+    {
+        std::cerr << "Not an encoded file." << std::endl;
+        return false;
+    }
+
+    input.prefetch(0, input.size());
+
+    size_t decodedSize = 0;
+    CubeStatus status = decodeCube(input, 0, side, schedule, arena, decodedSize, pool, options.verbose, !options.quiet);
+    if (status != CubeStatus::OK)
+    {
+        std::cerr << cubeStatusMessage(status) << std::endl;
+        return false;
+    }
+
+    const uint8_t* decodedBytes = arena.plain.data();
+
+    /* 
+     * 11. Extract string length and file suffix, see readHeader
+     */
+    stage(DECODE_WRITE_OUT);
+
+    FileHeader header;
+    if (readHeader(decodedBytes, decodedSize, header) == false)
+    {
+        std::cerr << "Error with file header." << std::endl;
+        return false;
+    }
+
+    if (header.streamed)
+    {
+        std::cerr << "This is only the first block of a larger file." << std::endl;
+        return false;
+    }
+
+    std::string outputFilename = getOutputPath(options, header.fileName);
+    if (skipExisting(outputFilename, options))
+        return true;
+
+    StageTimer metrics(false, false);
+    metrics.start(DECODE_WRITE_OUT, header.fileSize);
+
+    /*
+     * 12. Create output file with correct suffix using string length, skipping the 3 byte
+     * header and file name
+     */
+    if (writeFile(outputFilename, decodedBytes + header.size, size_t(header.fileSize), options.direct, options.existing) == false)
+    {
+        std::cerr << "Error writing file." << std::endl;
+        return false;
+    }
+
+    metrics.stop(header.fileSize);
+
+    stage(STAGE_END);
+    return true;
+}
+
+/*
+ * This is the driver for encoding files too big for one cube. Every STREAM_BLOCK_SIZE
+ * bytes of the file go through encodeCube on their own, so the output is just 16MB
+ * cubes back to back. The first block starts with the streamed header, see
+ * STREAMED_FILE_MARKER.
+ *
+ * Each thread in the pool takes a whole block, straight out of the mapping, so we
+ * encode a block per thread at once and write them out in order before starting the
+ * next lot.
+ *
+ * Memory: an arena (two 16MB buffers) for every thread, whatever the size of the
+ * file. The arenas are made once, here or by an earlier file, and reused for every block.
+ *
+ * @param inputFile                 name of the file to encode
+ * @param input                     the file, mapped
+ * @param schedule                  key tables, worked out once for every file
+ * @param arenas                    buffers to encode in, one per thread, added to if short
+ * @param pool                      threads to encode blocks on
+ * @param options                   output directory, O_DIRECT and progress, see JobOptions
+ *
+ * @return                          false, if for some reason we have an issue
+ *                                  true otherwise
+ */
+bool encodeStream(std::string inputFile, const MappedFile& input, const KeySchedule& schedule, std::vector<CubeArena>& arenas, ThreadPool& pool, const JobOptions& options)
+{
+    uint64_t fileSize = input.size();
+    uint64_t blockCount = (fileSize + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE;
+
+    std::string outputFilename = getOutputPath(options, getOutputFilename(inputFile));
+    if (skipExisting(outputFilename, options))
+        return true;
+
+    OutputFile output;
+    if (openOutputFile(outputFilename, output, blockCount * SIXTEEN_MEGABYTES, options.direct, options.existing) == false)
+        return false;
+
+    // the first block gets the streamed header, see buildHeader, the rest have none at all
+    std::vector<uint8_t> header, noHeader;
+    buildHeader(inputFile, fileSize, header);
+
+    // every thread has a block to itself, so the stages inside a block run on one thread
+    ThreadPool serial(1);
+    if (arenas.size() < pool.size())
+        arenas.resize(pool.size());
+
+    std::vector<CubeStatus> encoded(pool.size());
+
+    // the blocks are written out one at a time on this thread
+    StageTimer metrics(true, false);
+
+    input.prefetch(0, uint64_t(pool.size()) * STREAM_BLOCK_SIZE);
+
+    for (uint64_t first = 0; first < blockCount; first += pool.size())
+    {
+        size_t count = size_t(std::min<uint64_t>(pool.size(), blockCount - first));
+
+        // start reading the next lot in while we work on this one
+        input.prefetch((first + count) * STREAM_BLOCK_SIZE, uint64_t(count) * STREAM_BLOCK_SIZE);
+
+        pool.parallelFor(count, [&](size_t firstBlock, size_t lastBlock)
+        {
+            for (size_t i = firstBlock; i < lastBlock; i++)
+            {
+                uint64_t offset = (first + i) * STREAM_BLOCK_SIZE;
+                size_t length = size_t(std::min<uint64_t>(STREAM_BLOCK_SIZE, fileSize - offset));
+                encoded[i] = encodeCube((first + i == 0) ? header : noHeader, input, offset, length, RUBIX_SIDE_SIZE, options.paddingStream, schedule, arenas[i], serial, options.verbose, false);
+            }
+        });
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (encoded[i] != CubeStatus::OK)
+            {
+                std::cerr << cubeStatusMessage(encoded[i]) << std::endl;
+                return false;
+            }
+
+            metrics.start(ENCODE_WRITE_OUT, arenas[i].cube.size());
+            if (output.write(arenas[i].cube.data(), arenas[i].cube.size()) == false)
+            {
+                std::cerr << "Error writing file." << std::endl;
+                return false;
+            }
+            metrics.stop(arenas[i].cube.size());
+        }
+
+        if (!options.quiet)
+            updateBlocks(options.verbose, first + count, blockCount);
+    }
+
+    if (output.close() == false)
+    {
+        std::cerr << "Error writing file." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * This is the driver for decoding files written by encodeStream. Each thread takes a
+ * cube straight out of the mapping, the cubes are decoded at once and their bytes
+ * written out in order. The first block tells us the file name and size, and how many blocks
+ * there should be.
+ *
+ * Memory: an arena (two 16MB buffers) for every thread, whatever the size of the
+ * file. The arenas are made once, here or by an earlier file, and reused for every block.
+ *
+ * @param input                     the file to decode, mapped
+ * @param schedule                  key tables, worked out once for every file
+ * @param arenas                    buffers to decode in, one per thread, added to if short
+ * @param pool                      threads to decode blocks on
+ * @param options                   output directory, O_DIRECT and progress, see JobOptions
+ *
+ * @return                          false, if for some reason we have an issue
+ *                                  true otherwise
+ */
+bool decodeStream(const MappedFile& input, const KeySchedule& schedule, std::vector<CubeArena>& arenas, ThreadPool& pool, const JobOptions& options)
+{
+    uint64_t inputSize = input.size();
+
+    if ((inputSize == 0) || (inputSize % SIXTEEN_MEGABYTES != 0))
+    {
+        std::cerr << "File isn't a whole number of blocks." << std::endl;
+        return false;
+    }
+
+    uint64_t blockCount = inputSize / SIXTEEN_MEGABYTES;
+    uint64_t remaining = 0;
+    OutputFile output;
+
+    // every thread has a block to itself, so the stages inside a block run on one thread
+    ThreadPool serial(1);
+    if (arenas.size() < pool.size())
+        arenas.resize(pool.size());
+
+    std::vector<size_t> decodedSize(pool.size());
+    std::vector<CubeStatus> decoded(pool.size());
+
+    // the blocks are written out one at a time on this thread
+    StageTimer metrics(false, false);
+
+    input.prefetch(0, uint64_t(pool.size()) * SIXTEEN_MEGABYTES);
+
+    for (uint64_t first = 0; first < blockCount; first += pool.size())
+    {
+        size_t count = size_t(std::min<uint64_t>(pool.size(), blockCount - first));
+
+        // start reading the next lot in while we work on this one
+        input.prefetch((first + count) * SIXTEEN_MEGABYTES, uint64_t(count) * SIXTEEN_MEGABYTES);
+
+        pool.parallelFor(count, [&](size_t firstBlock, size_t lastBlock)
+        {
+            for (size_t i = firstBlock; i < lastBlock; i++)
+                decoded[i] = decodeCube(input, (first + i) * SIXTEEN_MEGABYTES, RUBIX_SIDE_SIZE, schedule, arenas[i], decodedSize[i], serial, options.verbose, false);
+        });
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (decoded[i] != CubeStatus::OK)
+            {
+                std::cerr << cubeStatusMessage(decoded[i]) << std::endl;
+                return false;
+            }
+
+            const uint8_t* block = arenas[i].plain.data();
+            size_t blockSize = decodedSize[i];
+            size_t start = 0;
+
+            // the first block has the header, see buildHeader
+            if (first + i == 0)
+            {
+                FileHeader header;
+                if ((readHeader(block, blockSize, header) == false) || !header.streamed
+                    || ((header.fileSize + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE != blockCount))
+                {
+                    std::cerr << "Error with file header." << std::endl;
+                    return false;
+                }
+
+                start = header.size;
+                remaining = header.fileSize;
+
+                std::string outputFilename = getOutputPath(options, header.fileName);
+                if (skipExisting(outputFilename, options))
+                    return true;
+
+                if (openOutputFile(outputFilename, output, remaining, options.direct, options.existing) == false)
+                    return false;
+            }
+
+            // every block but the last is full
+            if (blockSize - start != std::min<uint64_t>(STREAM_BLOCK_SIZE, remaining))
+            {
+                std::cerr << "Error with block " << first + i << '.' << std::endl;
+                return false;
+            }
+
+            metrics.start(DECODE_WRITE_OUT, blockSize - start);
+            if (output.write(block + start, blockSize - start) == false)
+            {
+                std::cerr << "Error writing file." << std::endl;
+                return false;
+            }
+            metrics.stop(blockSize - start);
+
+            remaining -= blockSize - start;
+        }
+
+        if (!options.quiet)
+            updateBlocks(options.verbose, first + count, blockCount);
+    }
+
+    if (output.close() == false)
+    {
+        std::cerr << "Error writing file." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * This function maps a file to encode or decode. Anything we're asked to decode has to
+ * be one cube, see cubeSideOf, or a run of full size ones.
+ *
+ * @param inputFile                 name of the file
+ * @param encoding                  true to encode, false to decode
+ * @param input                     the mapping to open
+ *
+ * @return                          false if we can't use the file
+ */
+bool openInputFile(std::string inputFile, bool encoding, MappedFile& input)
+{
+    if (input.open(inputFile) == false)
+    {
+        std::cerr << "Can't find input file: " << inputFile << std::endl;
+        return false;
+    }
+
+    if (!encoding && (cubeSideOf(input.size()) == 0) && ((input.size() < SIXTEEN_MEGABYTES) || (input.size() % SIXTEEN_MEGABYTES != 0)))
+    {
+        std::cerr << "Not an encoded file: " << inputFile << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * This function encodes or decodes one mapped file. Anything too big for one cube is
+ * streamed through a block at a time, see encodeStream.
+ *
+ * @param inputFile                 name of the file
+ * @param input                     the file, mapped
+ * @param schedule                  key tables, worked out once for every file
+ * @param arenas                    buffers to work in, added to if short
+ * @param pool                      threads to work on
+ * @param encoding                  true to encode, false to decode
+ * @param options                   output directory, O_DIRECT and progress, see JobOptions
+ *
+ * @return                          false, if for some reason we have an issue
+ *                                  true otherwise
+ */
+bool processFile(std::string inputFile, const MappedFile& input, const KeySchedule& schedule, std::vector<CubeArena>& arenas, ThreadPool& pool, bool encoding, const JobOptions& options)
+{
+    if (arenas.empty())
+        arenas.resize(1);
+
+    if (encoding)
+        return (input.size() > TWELVE_MEGABYTES)
+            ? encodeStream(inputFile, input, schedule, arenas, pool, options)
+            : encode(inputFile, input, schedule, arenas[0], pool, options);
+
+    return (input.size() > SIXTEEN_MEGABYTES)
+        ? decodeStream(input, schedule, arenas, pool, options)
+        : decode(input, schedule, arenas[0], pool, options);
 }
 
 /*
@@ -596,131 +1351,268 @@ void update(bool verbose, uint8_t stage)
         }
     }
     else
-    {
-        float progress = (float)(stage) / 5;
-        int barWidth = 70;
+        drawProgressBar((float)(stage) / 5);
+}
 
-        std::cout << "[";
-        int pos = (int)(barWidth * (progress));
-        for (int i = 0; i < barWidth; ++i) 
-        {
-            if (i < pos)        std::cout << "=";
-            else if (i == pos)  std::cout << ">";
-            else                std::cout << " ";
-        }
-        std::cout << "] " << int(progress * 100.0) << " %\r";
-        std::cout.flush();
+/*
+ * This function updates the user on how many blocks of a large file are done.
+ *
+ * @param   verbose             whether to write string output or progress bar
+ * @param   done                blocks done so far
+ * @param   total               blocks in the file
+ * @return  void
+*/
+void updateBlocks(bool verbose, uint64_t done, uint64_t total)
+{
+    if (verbose)
+        std::cout << "Block " << done << " of " << total << " done." << std::endl;
+    else
+        drawProgressBar((float)(done) / total);
+}
+
+/*
+ * This function draws the progress bar over the last one.
+ *
+ * @param   progress            fraction done, 0 to 1
+ * @return  void
+*/
+void drawProgressBar(float progress)
+{
+    int barWidth = 70;
+
+    std::cout << "[";
+    int pos = (int)(barWidth * (progress));
+    for (int i = 0; i < barWidth; ++i) 
+    {
+        if (i < pos)        std::cout << "=";
+        else if (i == pos)  std::cout << ">";
+        else                std::cout << " ";
     }
+    std::cout << "] " << int(progress * 100.0) << " %\r";
+    std::cout.flush();
 }
 
 /*
- * This function writes the encripted file to disk. I've templated it 
- * to eliminate duplicate work. The encode function calls this with 
- * uint32_t data type, decode with uint8_t data type. In either case,
- * we only care about the least significant byte.
+ * This function checks if we've been told to leave output files that are already
+ * there alone, and this one is.
  *
  * @param   outputFile               name of file to write
- * @param   fileBuffer               file buffer to write
+ * @param   options                  what to do with existing files, see JobOptions
+ * @return  bool                     true if the file is there and we're skipping it
+*/
+bool skipExisting(const std::string& outputFile, const JobOptions& options)
+{
+    if ((options.existing != ExistingFile::SKIP) || !std::filesystem::exists(outputFile))
+        return false;
+
+    if (options.verbose)
+        std::cout << outputFile << " already exists, skipped." << std::endl;
+
+    return true;
+}
+
+/*
+ * This function opens the output file. If it's already there we overwrite it, fail,
+ * or check with the user first, as we've been told.
+ *
+ * @param   outputFile               name of file to write
+ * @param   outfile                  file to open
+ * @param   expectedSize             how big the file will be, so it can be preallocated
+ * @param   direct                   write with O_DIRECT where we can
+ * @param   existing                 what to do if the file is already there, skipping
+ *                                   is up to the caller, see skipExisting
  * @return  bool
 */
-template <typename T>
-bool writeFile(std::string outputFile, std::vector < T > & fileBuffer)
+bool openOutputFile(std::string outputFile, OutputFile& outfile, uint64_t expectedSize, bool direct, ExistingFile existing)
 {
-    /*
-     * Check if output file already exists. If it does, do we want to 
-     * overwrite it or rename it?
-     * 
-     * C++ doesn't have a portable way to only get the character without
-     * user pressing ENTER, so we have to make sure any extra characters
-     * don't interfere.
-     */
-    while (std::filesystem::exists(outputFile))
+    // unless we've been told to overwrite, the file is only created if nothing's there, see OutputFile::open
+    bool overwrite = (existing == ExistingFile::OVERWRITE);
+
+    if (existing == ExistingFile::ASK)
     {
-        std::cout << '\n' << outputFile << " already exists.";
-        int ch;
-        do
+        /*
+         * Check if output file already exists. If it does, do we want to 
+         * overwrite it or rename it?
+         * 
+         * C++ doesn't have a portable way to only get the character without
+         * user pressing ENTER, so we have to make sure any extra characters
+         * don't interfere. Only one file at a time gets to ask, the lock is just
+         * for that. A batch never asks, so it never waits on this.
+         */
+        static std::mutex prompt;
+        std::lock_guard<std::mutex> lock(prompt);
+
+        while (!overwrite && std::filesystem::exists(outputFile))
         {
-            std::cout << "\n[O]verwrite or [R]ename ? ";
-            ch = toupper(std::getchar());
+            std::cout << '\n' << outputFile << " already exists.";
+            int ch;
+            do
+            {
+                std::cout << "\n[O]verwrite or [R]ename ? ";
+                ch = toupper(std::getchar());
 
-            // Ignore to the end of line
-            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                // nobody to answer (stdin is closed or redirected from a file), leave it alone
+                if ((ch == EOF) || !std::cin)
+                {
+                    std::cerr << "\nNo answer, not writing " << outputFile << std::endl;
+                    return false;
+                }
 
-            // reset the stream state.
-            std::cin.clear();
-        } while ((ch != 'O') && (ch != 'R'));
+                // Ignore to the end of line
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
-        if (ch == 'O')
-            break;
+                // reset the stream state.
+                std::cin.clear();
+            } while ((ch != 'O') && (ch != 'R'));
 
-        std::cout << "Enter new Filename: ";
-        std::getline(std::cin, outputFile);
+            if (ch == 'O')
+            {
+                overwrite = true;
+                break;
+            }
 
-        // reset the stream state.
-        std::cin.clear();
+            std::cout << "Enter new Filename: ";
+            if (!std::getline(std::cin, outputFile) || outputFile.empty())
+            {
+                std::cerr << "No new name, not writing the file." << std::endl;
+                return false;
+            }
+
+            // reset the stream state.
+            std::cin.clear();
+        }
     }
 
-    // Open the file in binary mode
-    std::ofstream outfile(outputFile, std::ios::binary);
+    // if someone else has made the file since we looked, it's still theirs
+    bool opened = outfile.open(outputFile, 0, direct, !overwrite);
+    if (!opened && (errno == EEXIST))
+    {
+        std::cerr << outputFile << " already exists." << std::endl;
+        return false;
+    }
 
-    // Check if the file opened successfully
-    if (!outfile.is_open()) 
+    if (!opened)
     {
         std::cerr << "Error opening file!" << std::endl;
         return false;
     }
 
-    // Write the data to the file
-    // We're only interested in the least significant byte to put in to the file
-    for (T byte : fileBuffer)
-        outfile.put(byte & 0xff);
-
-    // Close the file
-    outfile.close();
+    // reserve the space, which can take a while for a big file, once nothing's held
+    outfile.preallocate(expectedSize);
 
     return true;
 }
 
-#if TIMER
 /*
- * This function prints the time for each stage.
- * 
- * @param   none
- * @return  none
- */
-void writeTimeStats()
+ * This function writes the encripted file to disk. Both encode and
+ * decode hand it plain bytes, which go straight out in one big write.
+ *
+ * @param   outputFile               name of file to write
+ * @param   fileBuffer               data to write
+ * @param   count                    number of bytes to write
+ * @param   direct                   write with O_DIRECT where we can
+ * @param   existing                 what to do if the file is already there
+ * @return  bool
+*/
+bool writeFile(std::string outputFile, const uint8_t* fileBuffer, size_t count, bool direct, ExistingFile existing)
 {
-    std::array<std::string, 6> labels = { {"XOR = ", "HUFFMAN = ","RUBIX = ","SHUFFLE = ","WRITE = "} };
-    std::cout << std::fixed << std::setprecision(9) << std::left;
+    OutputFile outfile;
+    if (openOutputFile(outputFile, outfile, count, direct, existing) == false)
+        return false;
 
-    for (uint8_t i = 1; i < times.size(); i++)
-    {
-        std::chrono::duration<double> diff = times[i] - times[i-1];
-        std::cout << diff<< '\t';
-    }
+    bool ok = outfile.write(fileBuffer, count);
 
-    std::chrono::duration<double> diff = times[times.size()-1] - times[0];
-    std::cout << diff << '\n';
+    return outfile.close() && ok;
 }
-#endif
+
 /*
- * This function writes the XORs the file to encrypt with the key in 1000 byte chunks using
- * MAX_KEY_SIZE defined in the header.
+ * This function XORs the file to encrypt with the key in 1000 byte chunks using
+ * MAX_KEY_SIZE defined in the header. The work is done by the fastest kernel the CPU
+ * supports, see xor_kernel.cpp.
  *
  * @param   fileBuffer               file buffer to write
- * @param   key                       prepared key
+ * @param   size                     number of bytes in fileBuffer
+ * @param   schedule                  key pad and the kernel to use
  * @return  bool
 */
-void XORFileAndKey(std::vector<uint8_t>& fileBuffer, std::vector<uint8_t>& key)
+void XORFileAndKey(uint8_t* fileBuffer, size_t size, const KeySchedule& schedule)
+{
+    xorWithPad(fileBuffer, size, schedule.pad, schedule.xorKernel);
+}
+
+/*
+ * This function XORs the header and then the file against the key into the file buffer,
+ * so the file is read once straight from where it is instead of being copied in first.
+ * Same result as putting them together and XORing that.
+ *
+ * @param   header              bytes that go in front of the file
+ * @param   data                the file
+ * @param   dataSize            number of bytes in the file
+ * @param   fileBuffer          buffer to write, room for the header and the file
+ * @param   schedule            key pad and the kernel to use
+ * @return  void
+*/
+void XORFileAndKey(const std::vector<uint8_t>& header, const uint8_t* data, size_t dataSize, uint8_t* fileBuffer, const KeySchedule& schedule)
 {
-    int i = 0;
-    for (uint8_t &b : fileBuffer)
+    xorCopyWithPad(fileBuffer, header.data(), header.size(), 0, schedule.pad, schedule.xorKernel);
+    xorCopyWithPad(fileBuffer + header.size(), data, dataSize, header.size(), schedule.pad, schedule.xorKernel);
+}
+
+/*
+ * This function does the same XOR as the one above and counts the XORed bytes for the
+ * Huffman encoder on the way, one count per Huffman stream (see streamStart). Each
+ * XOR_COUNT_BLOCK bytes are counted straight after they're XORed, while they're still
+ * in the cache, so the buffer only comes in from memory once for both. The bytes we
+ * XORed from are counted too, from the same block, for incompressible to decide whether
+ * Huffman is worth it. The streams are shared out across the pool.
+ *
+ * @param   header              bytes that go in front of the file
+ * @param   data                the file
+ * @param   dataSize            number of bytes in the file
+ * @param   fileBuffer          buffer to write, room for the header and the file
+ * @param   schedule            key pad and the kernel to use
+ * @param   streamFreq          byte counts after the XOR, one per stream, sized by the caller
+ * @param   plainFreq           byte counts before the XOR, same size as streamFreq
+ * @param   pool                threads to split the streams across
+ * @return  void
+*/
+void XORFileAndKey(const std::vector<uint8_t>& header, const uint8_t* data, size_t dataSize, uint8_t* fileBuffer, const KeySchedule& schedule,
+    std::vector<std::array<uint32_t, 256>>& streamFreq, std::vector<std::array<uint32_t, 256>>& plainFreq, ThreadPool& pool)
+{
+    size_t total = header.size() + dataSize;
+    size_t streamCount = streamFreq.size();
+    plainFreq.resize(streamCount);
+
+    pool.parallelFor(streamCount, [&](size_t firstStream, size_t lastStream)
     {
-        b ^= key[i];
-        i = (i + 1) % MAX_KEY_SIZE;
-    }
+        for (size_t stream = firstStream; stream < lastStream; stream++)
+        {
+            streamFreq[stream].fill(0);
+            plainFreq[stream].fill(0);
+
+            size_t last = streamStart(total, stream + 1, streamCount);
+            for (size_t i = streamStart(total, stream, streamCount); i < last; )
+            {
+                // the header and the file come from different places, so a block doesn't cross between them
+                size_t count = std::min(XOR_COUNT_BLOCK, last - i);
+                const uint8_t* source = data + (i - header.size());
+                if (i < header.size())
+                {
+                    count = std::min(count, header.size() - i);
+                    source = header.data() + i;
+                }
+
+                xorCopyWithPad(fileBuffer + i, source, count, i, schedule.pad, schedule.xorKernel);
+                countBytes(source, count, plainFreq[stream]);
+                countBytes(fileBuffer + i, count, streamFreq[stream]);
+                i += count;
+            }
+        }
+    });
 }
 
+// the library build (libkhn) has no command line, see khn.h
+#ifndef KHN_LIBRARY
 /*
  * This function main entry point of the program. Used mainly as driver to parse the command line
  * options, get the encyption key, and read in the file to encrypt. Will print to standard error if
@@ -733,75 +1625,94 @@ void XORFileAndKey(std::vector<uint8_t>& fileBuffer, std::vector<uint8_t>& key)
 int main(int argc, char **argv)
 {
     std::map<std::string, std::string> commandLineOptions;
+    std::vector<std::string> inputFiles;
 
-    if (parseOptions(argc, argv, commandLineOptions) == false)
+    if (parseOptions(argc, argv, commandLineOptions, inputFiles) == false)
     {
         std::cout << "Invalid options" << std::endl;
         exit(-1);
     }
 
     /*
-     * Take key and truncate or fill to make it a full 1K
+     * Take key and truncate or fill to make it a full 1K, then work out everything we need
+     * from it, once for every file we're given
      */
-    std::vector<uint8_t> key;
-    if (getKey(commandLineOptions["keyFile"], key) == false)
+    KeySchedule schedule;
+    if (getKey(commandLineOptions["keyFile"], schedule) == false)
     {
         std::cerr << "Error with key." << std::endl;
         exit(-1);
     }
 
-    /* Take input file and load into a linear array.  At the start of the array include 
-     * information about the length of the string extracted from the file (4 bytes) and the 
-     * file suffix.  Pad out information beyond the end of the string with random bytes from 
-     * the original string to fill out the array to 16Mb.  Avoids strong pattern marking 
-     * end of cleartext 
-     */
-    std::vector<uint8_t> fileBuffer = { 0 };
-    int maxSize = (commandLineOptions["direction"] == "encode") ? TWELVE_MEGABYTES : SIXTEEN_MEGABYTES
-      , minSize = (commandLineOptions["direction"] == "encode") ? 0 : SIXTEEN_MEGABYTES;
+    ThreadPool pool(static_cast<unsigned>(std::stoul(commandLineOptions["threads"])));
 
-    if (readFile(commandLineOptions["encryptFile"], fileBuffer, minSize, maxSize) == false)
-    {
-        std::cerr << "Error with input file." << std::endl;
-        exit(-1);
-    }
+    // repeatable padding for benchmarks, instead of keying it from the OS
+    if (commandLineOptions.find("seed") != commandLineOptions.end())
+        seedPadding(std::stoull(commandLineOptions["seed"]));
 
-    if (commandLineOptions["direction"] == "encode")
-    {
-        /*
-         * write 3 bytes for the size of the file. I forgot my reasoning on why the byte
-         * order is like this, we only 3 bytes be cause 12MB < 2^32
-         */
-        uint32_t fileSize = static_cast<uint32_t>(fileBuffer.size());
-        for (int i = 2; i >= 0; i--)
-            fileBuffer.insert(fileBuffer.begin() + (2 - i), (fileSize >> (i * 8)) & 0xff);
+    // per stage numbers for --metrics, see metrics.h
+    if (commandLineOptions.find("metrics") != commandLineOptions.end())
+        enableMetrics(commandLineOptions["metrics"] == "json,perf", pool);
 
-        fileBuffer.insert(fileBuffer.begin() + 3, (uint8_t)commandLineOptions["encryptFile"].size());
+    bool encoding = (commandLineOptions["direction"] == "encode");
 
-        /*
-         * write the file name to the beginning of the buffer so we can extract it later
-         */
-        fileBuffer.insert(fileBuffer.begin() + 4, commandLineOptions["encryptFile"].begin(), commandLineOptions["encryptFile"].end());
+    JobOptions options;
+    options.direct = (commandLineOptions["direct"] == "true");
+    options.verbose = (commandLineOptions["verbose"] == "true");
+    options.outputDir = commandLineOptions["outputDir"];
+
+    if (commandLineOptions["existing"] == "overwrite")
+        options.existing = ExistingFile::OVERWRITE;
+    else if (commandLineOptions["existing"] == "skip")
+        options.existing = ExistingFile::SKIP;
+    else if (commandLineOptions["existing"] == "fail")
+        options.existing = ExistingFile::FAIL;
 
-        if (encode(fileBuffer, key, commandLineOptions["verbose"] == "true") == false)
+    /*
+     * More than one file, a wildcard or a directory is a batch, the files are shared out
+     * across the threads, see runBatch
+     */
+    if ((commandLineOptions["recursive"] == "true") || isBatch(inputFiles))
+    {
+        std::vector<BatchFile> files;
+        if (collectBatchFiles(inputFiles, commandLineOptions["recursive"] == "true", encoding, files) == false)
         {
-            std::cerr << "Error encoding file." << std::endl;
-            exit(1);
+            std::cerr << "Error with input file." << std::endl;
+            exit(-1);
         }
+
+        if (runBatch(files, schedule, encoding, options, pool) == false)
+            exit(1);
+
+        writeMetricsJson(std::cout, encoding, pool.size());
+        return 0;
     }
-    else
+
+    /* Map the input file so the stages can read it where it is rather than from a copy.
+     * When encoding, the XOR builds our working array: at the start of the array include
+     * information about the length of the string extracted from the file and the file
+     * suffix.  Pad out information beyond the end of the string with random bytes to fill
+     * out the array to 16Mb.  Avoids strong pattern marking end of cleartext
+     */
+    MappedFile input;
+    if (openInputFile(inputFiles[0], encoding, input) == false)
     {
-        if (decode(fileBuffer, key, commandLineOptions["verbose"] == "true") == false)
-        {
-            std::cerr << "Error encoding file." << std::endl;
-            exit(1);
-        }
+        std::cerr << "Error with input file." << std::endl;
+        exit(-1);
+    }
+
+    // every cube is worked in an arena, the streamed drivers add one per thread
+    std::vector<CubeArena> arenas(1);
+    options.paddingStream = reservePaddingStreams(1);
+    if (processFile(inputFiles[0], input, schedule, arenas, pool, encoding, options) == false)
+    {
+        std::cerr << "Error encoding file." << std::endl;
+        exit(1);
     }
 
     std::cout << std::endl;
-#if TIMER
-        writeTimeStats();
-#endif
+    writeMetricsJson(std::cout, encoding, pool.size());
 
     return 0;
 }
+#endif					// KHN_LIBRARY
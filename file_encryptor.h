@@ -6,32 +6,23 @@
 */
 #pragma once
 #include <algorithm>
+#include <array>
+#include <cerrno>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <random>
 #include <string>
 #include <vector>
 
-/*
- * we need this for strcmp for non-visual studio compilers
- * 
- * currently, printing std::chrono::duration not supported by STL in all compilers
- * it's available in Microsoft Visual C++ compiler
- */
-#ifdef _WIN32_
-#define TIMER 1
-#if TIMER
-#include <chrono>
-static std::vector<std::chrono::time_point<std::chrono::steady_clock>> times;
-#endif					// TIMER
-#else
-#define TIMER	0
-#endif
+#include "mapped_file.h"
+#include "output_file.h"
+#include "thread_pool.h"
 
 const uint32_t primes[] = {
 	2503,   2741,   10007,  12451,  17489,  17789,  28277,  32491,  36109,  39623,  42071,  43427,  55213,  55343,  64381,  64499,
@@ -172,21 +163,132 @@ const char PI[] = "\x0\x1\x4\x1\x5\x9\x2\x6\x5\x3\x5\x8\x9\x7\x9\x3\x2\x3\x8\x4\
 
 	constexpr uint16_t RUBIX_SIDE_SIZE	= 256;
 
+	/*
+	 * a file that fits in one cube gets the smallest of these that holds it, see
+	 * cubeSideFor. The cube size is the size of the .khn, which is all decoding needs to
+	 * know which it is. Streamed files are always RUBIX_SIDE_SIZE cubes
+	 */
+	constexpr uint16_t CUBE_SIDES[]		= { 16, 32, 64, 128, 256 };
+
 	const std::string FILE_EXTENSION	= "khn";
 
 	constexpr uint32_t META_DATA_SIZE	= 1028;
 
+	/*
+	 * metadata lives in the last META_DATA_SIZE bytes of the cube, whatever its size, and
+	 * the offsets below are from the start of it. The first 4 bytes are
+	 * the huffman string length, the top 4 bits of which hold the container version. The
+	 * string length can't reach 2^27 bits, so the original files always read as version 0.
+	 *
+	 *	version 0:	256 x 4 byte frequency map
+	 *	version 1:	256 x 1 byte canonical code lengths, followed by 4 byte symbol count
+	 *	version 2:	same as version 1, followed by a 4 byte stream count and the 4 byte bit
+	 *				length of each stream. Each stream starts on a byte, the string length
+	 *				is all the streams' bytes in bits
+	 *	version 3:	stored, the bytes weren't Huffman coded (see STORE_ENTROPY_BITS). Laid
+	 *				out like version 1 with the code lengths all zero, the string length
+	 *				is the symbol count in bits
+	 */
+	constexpr uint32_t STRING_LENGTH_OFFSET		= 0;
+	constexpr uint32_t FREQUENCY_MAP_OFFSET		= 4;
+	constexpr uint32_t CODE_LENGTHS_OFFSET		= 4;
+	constexpr uint32_t SYMBOL_COUNT_OFFSET		= CODE_LENGTHS_OFFSET + 256;
+	constexpr uint32_t STREAM_COUNT_OFFSET		= SYMBOL_COUNT_OFFSET + 4;
+	constexpr uint32_t STREAM_BITS_OFFSET		= STREAM_COUNT_OFFSET + 4;
+	constexpr uint32_t MAX_HUFFMAN_STREAMS		= 64;
+
+	constexpr uint8_t VERSION_SHIFT				= 28;
+	constexpr uint32_t STRING_LENGTH_MASK		= 0X0FFFFFFF;
+
+	constexpr uint8_t CONTAINER_FREQUENCY_MAP	= 0;
+	constexpr uint8_t CONTAINER_CODE_LENGTHS	= 1;
+	constexpr uint8_t CONTAINER_STREAMS			= 2;
+	constexpr uint8_t CONTAINER_STORED			= 3;
+
+	/*
+	 * files over 12MB are streamed, every STREAM_BLOCK_SIZE bytes of the file become a
+	 * cube of their own and the cubes are written back to back. The first block starts
+	 * with STREAMED_FILE_MARKER where the 3 byte file size would be (a single cube can't
+	 * get that big), then the file name length and name, then the 8 byte file size
+	 */
+	constexpr uint32_t STREAM_BLOCK_SIZE		= TWELVE_MEGABYTES;
+	constexpr uint32_t STREAMED_FILE_MARKER		= 0xFFFFFF;
+
+	// the fused XOR counts the bytes it has XORed this many at a time, while they're still in the cache
+	constexpr size_t XOR_COUNT_BLOCK			= 1 << 15;
+
+
+
+	/*
+	 * the cube holds one byte per element, the shift and shuffle work out where every
+	 * byte goes on the fly, so there's no need for room to tag elements with positions
+	 */
+	using FILE_BUFFER_TYPE = uint8_t;
+
+	/*
+	 * the two buffers every stage of a cube works in, sized to the cube by encodeCube
+	 * and decodeCube and reused for every cube after, so a stream of blocks or a run of
+	 * files only allocates when it meets a bigger cube than it's had. 'plain' holds the
+	 * header then the file either side of Huffman coding (it's never more than 12MB and
+	 * the header) and is the scratch cube for the Rubix shift and the shuffle. The
+	 * encoded cube ends up in 'cube'
+	 */
+	struct CubeArena
+	{
+		std::vector<FILE_BUFFER_TYPE> cube;
+		std::vector<FILE_BUFFER_TYPE> plain;
+	};
+
+	// everything the stages need from the key, worked out once, see key_schedule.h
+	struct KeySchedule;
 
+	// what can go wrong inside a cube, see cubeStatusMessage
+	enum class CubeStatus : uint8_t
+	{
+		OK,
+		BAD_HEADER,
+		HUFFMAN_ERROR,
+		UNKNOWN_VERSION,
+		BAD_CUBE_SIZE,
+	};
 
-	using FILE_BUFFER_TYPE = uint32_t;
+	/*
+	 * the header in front of the file in the first cube, see buildHeader. size is how
+	 * many bytes of the cube it takes up, the file starts right after it
+	 */
+	struct FileHeader
+	{
+		std::string fileName;
+		uint64_t fileSize = 0;
+		size_t size = 0;
+		bool streamed = false;
+	};
 
-	constexpr uint8_t X_OFFSET			= 8;
-	constexpr uint8_t Y_OFFSET			= 16;
-	constexpr uint8_t Z_OFFSET			= 24;
+	// what to do when the output file is already there, see openOutputFile and --existing
+	enum class ExistingFile : uint8_t
+	{
+		ASK,
+		OVERWRITE,
+		SKIP,
+		FAIL,
+	};
 
-	constexpr uint32_t X_MASK			= 0XFFFF00FF;
-	constexpr uint32_t Y_MASK			= 0XFF00FFFF;
-	constexpr uint32_t Z_MASK			= 0X00FFFFFF;
+	/*
+	 * how the drivers write their output and report progress. With an outputDir the
+	 * output goes in there under its own name, otherwise it goes beside the input when
+	 * encoding and where the header says when decoding. quiet is for files of a batch,
+	 * which report once they're done rather than stage by stage. A batch never asks
+	 * about existing files, see runBatch
+	 */
+	struct JobOptions
+	{
+		bool direct = false;
+		bool verbose = false;
+		bool quiet = false;
+		ExistingFile existing = ExistingFile::ASK;
+		uint64_t paddingStream = 0;		// see reservePaddingStreams
+		std::string outputDir;
+	};
 
 	constexpr uint8_t ENCODE_XOR		= 0;
 	constexpr uint8_t ENCODE_HUFFMAN	= 1;
@@ -203,16 +305,34 @@ const char PI[] = "\x0\x1\x4\x1\x5\x9\x2\x6\x5\x3\x5\x8\x9\x7\x9\x3\x2\x3\x8\x4\
 	constexpr uint8_t STAGE_END			= 5;
 
 //Function prototypes
-void		addPadding(std::vector<uint32_t>& vec, uint32_t index);
-bool		decode(std::vector<uint8_t>& fileBuffer, std::vector<uint8_t>& key, bool verbose);
-bool		encode(std::vector<uint8_t>& fileBuffer, std::vector<uint8_t>& key, bool verbose);
-bool		getKey(std::string inputFile, std::vector<uint8_t>& keyFileBuffer);
-uint32_t	getPrime(uint8_t index);
-bool		parseOptions(int argc, char** argv, std::map<std::string, std::string>& command_line_options);
+void		addPadding(std::vector<FILE_BUFFER_TYPE>& vec, uint32_t index, uint64_t stream, uint64_t cube);
+void		buildHeader(const std::string& fileName, uint64_t fileSize, std::vector<uint8_t>& header);
+uint32_t	cubeSideFor(size_t payloadSize);
+uint32_t	cubeSideOf(uint64_t cubeSize);
+const char*	cubeStatusMessage(CubeStatus status);
+bool		decode(const MappedFile& input, const KeySchedule& schedule, CubeArena& arena, ThreadPool& pool, const JobOptions& options);
+CubeStatus	decodeCube(const MappedFile& input, uint64_t offset, uint32_t side, const KeySchedule& schedule, CubeArena& arena, size_t& decodedSize, ThreadPool& pool, bool verbose, bool showStages);
+bool		decodeStream(const MappedFile& input, const KeySchedule& schedule, std::vector<CubeArena>& arenas, ThreadPool& pool, const JobOptions& options);
+void		drawProgressBar(float progress);
+bool		encode(std::string inputFile, const MappedFile& input, const KeySchedule& schedule, CubeArena& arena, ThreadPool& pool, const JobOptions& options);
+CubeStatus	encodeCube(const std::vector<uint8_t>& header, const MappedFile& input, uint64_t offset, size_t length, uint32_t side, uint64_t paddingStream, const KeySchedule& schedule, CubeArena& arena, ThreadPool& pool, bool verbose, bool showStages);
+bool		encodeStream(std::string inputFile, const MappedFile& input, const KeySchedule& schedule, std::vector<CubeArena>& arenas, ThreadPool& pool, const JobOptions& options);
+bool		getKey(std::string inputFile, KeySchedule& schedule);
+std::string	getOutputFilename(std::string fileName);
+std::string	getOutputPath(const JobOptions& options, std::string fileName);
+bool		openInputFile(std::string inputFile, bool encoding, MappedFile& input);
+bool		openOutputFile(std::string outputFile, OutputFile& outfile, uint64_t expectedSize, bool direct, ExistingFile existing);
+bool		parseOptions(int argc, char** argv, std::map<std::string, std::string>& command_line_options, std::vector<std::string>& inputFiles);
+bool		prepareKey(std::vector<uint8_t>& key);
 void		printMatrix(std::string remark, std::vector<FILE_BUFFER_TYPE>& matrix3d);
+bool		processFile(std::string inputFile, const MappedFile& input, const KeySchedule& schedule, std::vector<CubeArena>& arenas, ThreadPool& pool, bool encoding, const JobOptions& options);
+bool		readHeader(const uint8_t* bytes, size_t count, FileHeader& header);
 bool		readFile(std::string input_file, std::vector<uint8_t>& inputFileBuffer, uint32_t minSize, uint32_t maxSize);
+bool		skipExisting(const std::string& outputFile, const JobOptions& options);
 void		update(bool verbose, uint8_t stage);
-void		XORFileAndKey(std::vector<uint8_t>& fileBuffer, std::vector<uint8_t>& key);
+void		updateBlocks(bool verbose, uint64_t done, uint64_t total);
+void		XORFileAndKey(uint8_t* fileBuffer, size_t size, const KeySchedule& schedule);
+void		XORFileAndKey(const std::vector<uint8_t>& header, const uint8_t* data, size_t dataSize, uint8_t* fileBuffer, const KeySchedule& schedule);
+void		XORFileAndKey(const std::vector<uint8_t>& header, const uint8_t* data, size_t dataSize, uint8_t* fileBuffer, const KeySchedule& schedule, std::vector<std::array<uint32_t, 256>>& streamFreq, std::vector<std::array<uint32_t, 256>>& plainFreq, ThreadPool& pool);
 
-template <typename T>
-bool		writeFile(std::string output_file, std::vector < T >& fileBuffer);
+bool		writeFile(std::string output_file, const uint8_t* fileBuffer, size_t count, bool direct, ExistingFile existing);
@@ -4,129 +4,757 @@
 * 
 * taken from https://www.geeksforgeeks.org/huffman-coding-in-cpp/
 * contains some functions for creating the huffman coding
-* 
-* TODO: find the decoding functions
-*       possibly better implementations, maybe one that isn't recursive, but we probably won't
-*           have to recurse as much as initially anticipated
 */
 #include "huffman.h"
+#include <cmath>
+#include <cstring>
 
 /*
-* this recursively generates the huffman codes
-* 
-* @param    root                pointer to a Node structure
-* @param    code                current code
-* @param    codes               map of a character to its corresponding huffman code
-* 
-* TODO: consider a non-recursive solution
-* 
+* Function to build the Huffman tree. All 256 symbols go in as leaves, then we keep
+* pulling the two lightest nodes off the priority queue and joining them under a new
+* internal node until only the root is left. The queue holds indexes into the tree's
+* node array rather than pointers, so there's nothing to clean up afterwards.
+*
+* This is only used to decode the original container format, which only kept the
+* frequency map. The order nodes come off the queue decides which of several equally
+* good trees we get, so this has to stay the same as the original pointer based
+* version or those files won't decode anymore.
+*
+* @param    freqMap         map of frequencies of each character in the input file
+* @param    tree            tree to build
+*
 * @return   none
 */
-void generateCodes(Node* root, std::string code, std::map<unsigned char, std::string>& codes)
+void buildHuffmanTree(const std::array<uint32_t, 256>& freqMap, HuffmanTree& tree)
 {
-    if (root == nullptr) return;
+    // Custom comparator for the priority queue
+    auto Compare = [&tree](int16_t l, int16_t r) {return tree.nodes[l].freq > tree.nodes[r].freq; };
+    std::vector<int16_t> storage;
+    storage.reserve(256);
+    std::priority_queue<int16_t, std::vector<int16_t>, decltype(Compare)> pq(Compare, std::move(storage));
+
+    tree.count = 0;
+
+    // Create leaf nodes for each character
+    for (size_t i = 0; i < 256; i++)
+    {
+        tree.nodes[tree.count] = { freqMap[i], NO_NODE, NO_NODE, uint8_t(i) };
+        pq.push(int16_t(tree.count++));
+    }
 
-    if (!root->left && !root->right)
-        codes[root->ch] = code;
+    // Build the tree
+    while (pq.size() > 1)
+    {
+        int16_t left = pq.top(); pq.pop();
+        int16_t right = pq.top(); pq.pop();
 
-    generateCodes(root->left, code + "0", codes);
-    generateCodes(root->right, code + "1", codes);
+        tree.nodes[tree.count] = { tree.nodes[left].freq + tree.nodes[right].freq, left, right, 0 };
+        pq.push(int16_t(tree.count++));
+    }
+
+    tree.root = pq.top();
 }
 
 /*
-* Function to build the Huffman tree
-* 
-* @param    freqmap         map of frequencies of each character in the input file
-* 
-* TODO: figure out how this works to document it better.
-* 
-* @return   Node*           pointer to a Node structure
+* Works out the code length for every symbol that actually shows up in the input.
+* Symbols with a zero frequency are left out completely, so they don't eat any of the
+* code space. Once the leaves are sorted by frequency we can build the tree in linear
+* time with two queues, the sorted leaves and the internal nodes, which come out in
+* increasing weight order on their own. Nodes live in flat arrays, only the parent of
+* each node is kept, which is all we need to get the depths.
+*
+* @param    freq                frequency map of the input
+* @param    lengths             code length per symbol, 0 for unused symbols
+*
+* @return   bool                false if a code doesn't fit in MAX_PACKED_CODE_LENGTH
 */
-Node* buildHuffmanTree(const std::array<uint32_t, 256>& freqMap)
+bool buildCodeLengths(const std::array<uint32_t, 256>& freq, std::array<uint8_t, 256>& lengths)
 {
-    // Custom comparator for the priority queue
-    auto Compare = [](Node* const& l, Node* const& r) {return l->freq > r->freq; };
-    std::priority_queue<Node*, std::vector<Node*>, decltype(Compare)> pq(Compare);
+    lengths.fill(0);
 
-    // Create leaf nodes for each character
-    for (size_t i = 0; i < 256; i++)
-        pq.push(new Node((char)i, freqMap[i]));
+    std::array<uint8_t, 256> symbols;
+    uint16_t leafCount = 0;
+    for (uint16_t i = 0; i < 256; i++)
+        if (freq[i] != 0)
+            symbols[leafCount++] = uint8_t(i);
 
-    // Build the tree
-    while (pq.size() > 1)
+    if (leafCount == 0)
+        return true;
+
+    // a single symbol still needs one bit per byte so the decoder can count them
+    if (leafCount == 1)
     {
-        Node* left = pq.top(); pq.pop();
-        Node* right = pq.top(); pq.pop();
+        lengths[symbols[0]] = 1;
+        return true;
+    }
+
+    std::stable_sort(symbols.begin(), symbols.begin() + leafCount,
+        [&freq](uint8_t l, uint8_t r) { return freq[l] < freq[r]; });
 
-        Node* internalNode = new Node('\0', left->freq + right->freq);
-        internalNode->left = left;
-        internalNode->right = right;
-        pq.push(internalNode);
+    // leaves are 0 .. leafCount - 1, internal nodes follow in the order we make them
+    std::array<uint64_t, MAX_TREE_NODES> weight;
+    std::array<uint16_t, MAX_TREE_NODES> parent;
+    for (uint16_t i = 0; i < leafCount; i++)
+        weight[i] = freq[symbols[i]];
+
+    uint16_t nextLeaf = 0, nextInternal = leafCount, nodeCount = leafCount;
+
+    // take the lighter of the two queue fronts, leaves win ties
+    auto takeLightest = [&]() -> uint16_t
+    {
+        if ((nextLeaf < leafCount)
+            && ((nextInternal == nodeCount) || (weight[nextLeaf] <= weight[nextInternal])))
+            return nextLeaf++;
+
+        return nextInternal++;
+    };
+
+    while (nodeCount < (2 * leafCount) - 1)
+    {
+        uint16_t left = takeLightest();
+        uint16_t right = takeLightest();
+
+        weight[nodeCount] = weight[left] + weight[right];
+        parent[left] = parent[right] = nodeCount;
+        nodeCount++;
     }
 
-    return pq.top();
+    // the root is made last, walk back down giving every node its parent's depth + 1
+    std::array<uint16_t, MAX_TREE_NODES> depth;
+    depth[nodeCount - 1] = 0;
+    for (int i = nodeCount - 2; i >= 0; i--)
+        depth[i] = depth[parent[i]] + 1;
+
+    for (uint16_t i = 0; i < leafCount; i++)
+    {
+        if (depth[i] > MAX_PACKED_CODE_LENGTH)
+            return false;
+
+        lengths[symbols[i]] = uint8_t(depth[i]);
+    }
+
+    return true;
 }
 
-bool huffmanEncode(std::vector<uint8_t>& input, std::array<uint32_t, 256>& freq, std::vector<uint8_t>& encodedBytes, uint32_t &stringLength)
+/*
+* Assigns canonical codes from the code lengths. Shorter codes come first and codes of
+* the same length go in symbol order, so the lengths are all anyone needs to rebuild
+* exactly the same codes.
+*
+* @param    lengths             code length per symbol, 0 for unused symbols
+* @param    table               flat code table, indexed by symbol
+*
+* @return   bool                false if the lengths don't describe a usable code
+*/
+bool buildCanonicalCodes(const std::array<uint8_t, 256>& lengths, std::array<HuffmanCode, 256>& table)
 {
-    for (auto i : input)
-        freq[i]++;
+    table.fill({ 0, 0 });
 
-    Node* root = buildHuffmanTree(freq);
-
-    std::map<unsigned char, std::string> codes;
-    generateCodes(root, "", codes);
+    std::array<uint32_t, MAX_PACKED_CODE_LENGTH + 1> lengthCount = { 0 };
+    for (uint8_t length : lengths)
+    {
+        if (length > MAX_PACKED_CODE_LENGTH)
+            return false;
 
-    std::string encodedString;
-    for (auto c : input)
-        encodedString += codes[c];
+        lengthCount[length]++;
+    }
+    lengthCount[0] = 0;
 
-    stringLength = static_cast<uint32_t>(encodedString.length());
-    
     /*
-     * we need to account for strings that don't end on byte boundry,
-     * so let's pad it with '0's
+     * next code for each length, same as deflate. If we run out of codes at any
+     * length, the lengths can't have come from a huffman tree
      */
-    encodedString.resize(stringLength + (8 - (stringLength % 8)), '0');
+    std::array<uint64_t, MAX_PACKED_CODE_LENGTH + 1> nextCode = { 0 };
+    uint64_t code = 0;
+    for (uint8_t length = 1; length <= MAX_PACKED_CODE_LENGTH; length++)
+    {
+        code = (code + lengthCount[length - 1]) << 1;
+        nextCode[length] = code;
 
-    for (int i = 0; i < encodedString.size(); i += 8)
-        encodedBytes.push_back(uint8_t(std::bitset<8>(encodedString.substr(i, 8)).to_ulong()));
+        if ((length < MAX_PACKED_CODE_LENGTH) && (code + lengthCount[length] > (uint64_t(1) << length)))
+            return false;
+    }
+
+    for (uint16_t i = 0; i < 256; i++)
+        if (lengths[i] != 0)
+            table[i] = { nextCode[lengths[i]]++, lengths[i] };
 
     return true;
 }
 
-// Function to decode a given Huffman encoded string
-bool huffmanDecode(std::string &input, std::array<uint32_t, 256>& freq, std::vector<uint8_t>& decodedBytes)
+/*
+* Rebuilds a tree from the canonical code lengths so the decoder can use the same
+* lookup table as the older format. It's just one insert per symbol, no priority
+* queue. The lengths have to describe a complete code (or a single one bit code),
+* otherwise we'd have holes in the tree, which usually means the wrong key.
+*
+* @param    lengths             code length per symbol, 0 for unused symbols
+* @param    tree                tree to build
+*
+* @return   bool                false if the lengths don't describe a usable code
+*/
+bool buildCanonicalTree(const std::array<uint8_t, 256>& lengths, HuffmanTree& tree)
 {
-    Node* root = buildHuffmanTree(freq);
+    std::array<HuffmanCode, 256> table;
+    if (buildCanonicalCodes(lengths, table) == false)
+        return false;
 
-    std::map<unsigned char, std::string> codes;
-    generateCodes(root, "", codes);
+    tree.count = 0;
+    tree.nodes[tree.count] = { 0, NO_NODE, NO_NODE, 0 };
+    tree.root = int16_t(tree.count++);
 
-    Node* curr = root;
-    for (char bit : input) 
+    uint16_t symbolCount = 0;
+    for (uint16_t i = 0; i < 256; i++)
     {
-        if (bit == '0')
+        if (table[i].length == 0)
+            continue;
+
+        symbolCount++;
+        int16_t curr = tree.root;
+        for (int bit = table[i].length - 1; bit >= 0; bit--)
         {
-            if ((curr != nullptr) && (curr->left != nullptr))
-               curr = curr->left;
+            // can't pass through another symbol
+            if (tree.nodes[curr].freq != 0)
+                return false;
+
+            // internal nodes always get both children, so isLeaf() keeps working
+            if (tree.nodes[curr].left == NO_NODE)
+            {
+                if (tree.count + 2 > MAX_TREE_NODES)
+                    return false;
+
+                tree.nodes[curr].left = int16_t(tree.count);
+                tree.nodes[tree.count++] = { 0, NO_NODE, NO_NODE, 0 };
+                tree.nodes[curr].right = int16_t(tree.count);
+                tree.nodes[tree.count++] = { 0, NO_NODE, NO_NODE, 0 };
+            }
+
+            curr = ((table[i].bits >> bit) & 1) ? tree.nodes[curr].right : tree.nodes[curr].left;
         }
+
+        tree.nodes[curr].ch = uint8_t(i);
+        tree.nodes[curr].freq = 1;
+    }
+
+    /*
+     * every leaf we made has to end up with a symbol on it, that's the case exactly
+     * when the code is complete. A lone one bit code leaves its sibling empty.
+     */
+    for (uint16_t i = 0; i < tree.count; i++)
+        if (tree.isLeaf(int16_t(i)) && (tree.nodes[i].freq == 0) && (symbolCount > 1))
+            return false;
+
+    return symbolCount > 0;
+}
+
+/*
+* Packs one chunk of the input into the output, starting at bit firstBit. Codes are
+* shifted into a 64 bit accumulator most significant bit first and every time it fills
+* up, we store the whole word big-endian. The chunk next door may own part of our first
+* or last word, so those two are handed back in 'edges' instead of being stored, the
+* caller ORs them in once every chunk is done.
+*
+* @param    first               first byte of the chunk
+* @param    last                one past the last byte of the chunk
+* @param    table               code for each symbol
+* @param    firstBit            bit offset the chunk starts at
+* @param    lastBit             bit offset the chunk ends at
+* @param    out                 packed output, whole words, zeroed
+* @param    edges               first and last word of the chunk if they're shared
+*
+* @return   none
+*/
+static void packChunk(const uint8_t* first, const uint8_t* last, const std::array<HuffmanCode, 256>& table,
+    uint64_t firstBit, uint64_t lastBit, uint8_t* out, std::array<uint64_t, 2>& edges)
+{
+    const size_t headWord = size_t(firstBit / 64), tailWord = size_t(lastBit / 64);
+    const bool headShared = (firstBit % 64) != 0, tailShared = (lastBit % 64) != 0;
+
+    size_t wordIndex = headWord;
+    uint64_t accumulator = 0;
+    uint32_t used = uint32_t(firstBit % 64);
+
+    auto storeWord = [&](uint64_t word)
+    {
+        if (headShared && wordIndex == headWord)
+            edges[0] |= word;
+        else if (tailShared && wordIndex == tailWord)
+            edges[1] |= word;
         else
+            for (int shift = 56, i = 0; shift >= 0; shift -= 8, i++)
+                out[wordIndex * 8 + i] = uint8_t(word >> shift);
+
+        wordIndex++;
+    };
+
+    for (const uint8_t* c = first; c != last; c++)
+    {
+        const HuffmanCode& code = table[*c];
+
+        if (used + code.length < 64)
         {
-            if ((curr != nullptr) && (curr->right != nullptr))
-                curr = curr->right;
+            accumulator |= code.bits << (64 - used - code.length);
+            used += code.length;
         }
-        // Reached a leaf node
-        if ((curr != nullptr)
-            && (curr->left == nullptr)
-            && (curr->right == nullptr)
-        ) 
+        else
         {
-            //cout << curr->ch;
-            decodedBytes.push_back(curr->ch);
-            curr = root;
+            // top part of the code finishes this word, whatever is left starts the next
+            uint32_t spill = used + code.length - 64;
+            storeWord(accumulator | (code.bits >> spill));
+            accumulator = (spill == 0) ? 0 : code.bits << (64 - spill);
+            used = spill;
         }
     }
 
+    if (used > 0)
+        storeWord(accumulator);
+}
+
+/*
+* Works out where a stream starts in the input, the input is split as evenly as we can
+* and the decoder splits the symbol count the same way.
+*
+* @param    symbolCount         number of bytes across all the streams
+* @param    stream              stream to find, streamCount gives the end of the last
+* @param    streamCount         number of streams
+*
+* @return   size_t              index of the first byte of the stream
+*/
+size_t streamStart(size_t symbolCount, size_t stream, size_t streamCount)
+{
+    return size_t(uint64_t(symbolCount) * stream / streamCount);
+}
+
+/*
+* Counts how many times each byte value turns up, adding to counts. The counts are spread
+* over COUNT_TABLES tables, a byte at a time round them, so a run of the same byte isn't
+* held up by each increment waiting on the store of the one before. They're added
+* together at the end.
+*
+* @param    input               bytes to count
+* @param    length              number of bytes
+* @param    counts              running counts, added to here
+*
+* @return   none
+*/
+void countBytes(const uint8_t* input, size_t length, std::array<uint32_t, 256>& counts)
+{
+    uint32_t tables[COUNT_TABLES][256] = {};
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, input + i, sizeof(word));
+
+        tables[0][uint8_t(word)]++;
+        tables[1][uint8_t(word >> 8)]++;
+        tables[2][uint8_t(word >> 16)]++;
+        tables[3][uint8_t(word >> 24)]++;
+        tables[0][uint8_t(word >> 32)]++;
+        tables[1][uint8_t(word >> 40)]++;
+        tables[2][uint8_t(word >> 48)]++;
+        tables[3][uint8_t(word >> 56)]++;
+    }
+
+    for (; i < length; i++)
+        tables[0][input[i]]++;
+
+    for (uint16_t value = 0; value < 256; value++)
+        for (uint8_t t = 0; t < COUNT_TABLES; t++)
+            counts[value] += tables[t][value];
+}
+
+/*
+* Works out the Shannon entropy of the bytes counted in a histogram, the fewest bits per
+* byte any code built from it can average.
+*
+* @param    freq                how many times each byte value turns up
+*
+* @return   double              bits per byte, 0 to 8
+*/
+double byteEntropy(const std::array<uint32_t, 256>& freq)
+{
+    uint64_t total = 0;
+    for (uint32_t count : freq)
+        total += count;
+
+    if (total == 0)
+        return 0;
+
+    double entropy = 0;
+    for (uint32_t count : freq)
+    {
+        if (count == 0)
+            continue;
+
+        double p = double(count) / double(total);
+        entropy -= p * std::log2(p);
+    }
+
+    return entropy;
+}
+
+/*
+* Decides whether bytes are too close to random for Huffman to make them any smaller,
+* going by their entropy against STORE_ENTROPY_BITS. The counts have to be of the bytes
+* before they're XORed, the key pad flattens anything it's run over, text included, so
+* afterwards everything looks incompressible.
+*
+* @param    plainFreq           byte counts before the XOR, in as many parts as the caller likes
+*
+* @return   bool                true if the bytes should be stored as they are
+*/
+bool incompressible(const std::vector<std::array<uint32_t, 256>>& plainFreq)
+{
+    std::array<uint32_t, 256> freq = { 0 };
+    for (const auto& counts : plainFreq)
+        for (size_t i = 0; i < freq.size(); i++)
+            freq[i] += counts[i];
+
+    return byteEntropy(freq) > STORE_ENTROPY_BITS;
+}
+
+/*
+* Huffman encodes the input straight into packed bytes, cut into streamBits.size()
+* streams that can each be decoded on their own. Counts each stream's bytes, see
+* the version below for the rest.
+*
+* @param    input               bytes to encode
+* @param    inputSize           number of bytes to encode
+* @param    lengths             canonical code lengths, filled in here
+* @param    encodedBytes        packed output, the streams back to back
+* @param    capacity            size of encodedBytes
+* @param    encodedSize         number of bytes packed, set here
+* @param    streamBits          number of valid bits in each stream, sized by the caller
+* @param    store               copy the input across rather than encode it, see incompressible
+* @param    pool                threads to split the streams across
+*
+* @return   bool                false if we can't build a usable code table or it won't fit
+*/
+bool huffmanEncode(const uint8_t* input, size_t inputSize, std::array<uint8_t, 256>& lengths, uint8_t* encodedBytes, size_t capacity,
+    size_t& encodedSize, std::vector<uint32_t>& streamBits, bool store, ThreadPool& pool)
+{
+    const size_t streamCount = streamBits.size();
+    if ((streamCount == 0) || (streamCount > MAX_HUFFMAN_STREAMS))
+        return false;
+
+    std::vector<std::array<uint32_t, 256>> streamFreq(streamCount);
+    pool.parallelFor(streamCount, [&](size_t firstStream, size_t lastStream)
+    {
+        for (size_t stream = firstStream; stream < lastStream; stream++)
+        {
+            size_t first = streamStart(inputSize, stream, streamCount);
+            streamFreq[stream].fill(0);
+            countBytes(input + first, streamStart(inputSize, stream + 1, streamCount) - first, streamFreq[stream]);
+        }
+    });
+
+    return huffmanEncode(input, inputSize, streamFreq, lengths, encodedBytes, capacity, encodedSize, streamBits, store, pool);
+}
+
+/*
+* Huffman encodes the input straight into packed bytes, cut into streamBits.size()
+* streams that can each be decoded on their own. Each stream's byte counts have
+* already been taken (on the way through the XOR, see XORFileAndKey), which gives us
+* the code table and also exactly how many bits each stream will produce. Streams
+* start on a byte boundary, so a running total of their byte sizes tells every stream
+* where to go and they can all pack at once across the pool. The output goes into the
+* caller's buffer, and it comes out the same whatever the thread count.
+*
+* If we're told to store the input, because incompressible said Huffman can't make it
+* meaningfully smaller, the bytes are copied across as they are. The lengths and
+* stream bits are all zero then.
+*
+* @param    input               bytes to encode
+* @param    inputSize           number of bytes to encode
+* @param    streamFreq          byte counts of each stream, split by streamStart
+* @param    lengths             canonical code lengths, filled in here
+* @param    encodedBytes        packed output, the streams back to back
+* @param    capacity            size of encodedBytes
+* @param    encodedSize         number of bytes packed, set here
+* @param    streamBits          number of valid bits in each stream, sized by the caller
+* @param    store               copy the input across rather than encode it, see incompressible
+* @param    pool                threads to split the streams across
+*
+* @return   bool                false if we can't build a usable code table or it won't fit
+*/
+bool huffmanEncode(const uint8_t* input, size_t inputSize, const std::vector<std::array<uint32_t, 256>>& streamFreq, std::array<uint8_t, 256>& lengths,
+    uint8_t* encodedBytes, size_t capacity, size_t& encodedSize, std::vector<uint32_t>& streamBits, bool store, ThreadPool& pool)
+{
+    const size_t streamCount = streamBits.size();
+    if ((streamCount == 0) || (streamCount > MAX_HUFFMAN_STREAMS) || (streamFreq.size() != streamCount))
+        return false;
+
+    if (store)
+    {
+        if (inputSize > capacity)
+            return false;
+
+        lengths.fill(0);
+        std::fill(streamBits.begin(), streamBits.end(), 0);
+        std::memcpy(encodedBytes, input, inputSize);
+        encodedSize = inputSize;
+
+        return true;
+    }
+
+    std::array<uint32_t, 256> freq = { 0 };
+    for (const auto& counts : streamFreq)
+        for (size_t i = 0; i < freq.size(); i++)
+            freq[i] += counts[i];
+
+    std::array<HuffmanCode, 256> table;
+    if ((buildCodeLengths(freq, lengths) == false) || (buildCanonicalCodes(lengths, table) == false))
+        return false;
+
+    // firstBit[i] is where stream i starts, always on a byte, the last one is the total
+    std::vector<uint64_t> firstBit(streamCount + 1, 0);
+    for (size_t stream = 0; stream < streamCount; stream++)
+    {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < freq.size(); i++)
+            bits += uint64_t(streamFreq[stream][i]) * table[i].length;
+
+        if (bits > UINT32_MAX)
+            return false;
+
+        streamBits[stream] = static_cast<uint32_t>(bits);
+        firstBit[stream + 1] = firstBit[stream] + ((bits + 7) / 8) * 8;
+    }
+
+    // round up to a whole word so the last store doesn't have to be special cased
+    size_t byteCount = size_t(firstBit[streamCount] / 8);
+    if (((byteCount + 7) / 8) * 8 > capacity)
+        return false;
+
+    std::fill(encodedBytes, encodedBytes + ((byteCount + 7) / 8) * 8, uint8_t(0));
+
+    std::vector<std::array<uint64_t, 2>> edges(streamCount, { 0, 0 });
+    pool.parallelFor(streamCount, [&](size_t firstStream, size_t lastStream)
+    {
+        for (size_t stream = firstStream; stream < lastStream; stream++)
+            packChunk(input + streamStart(inputSize, stream, streamCount), input + streamStart(inputSize, stream + 1, streamCount),
+                table, firstBit[stream], firstBit[stream] + streamBits[stream], encodedBytes, edges[stream]);
+    });
+
+    // stitch in the words that straddle two streams, bits never overlap so OR is enough
+    for (size_t stream = 0; stream < streamCount; stream++)
+    {
+        const size_t words[2] = { size_t(firstBit[stream] / 64), size_t((firstBit[stream] + streamBits[stream]) / 64) };
+        for (int e = 0; e < 2; e++)
+            for (int shift = 56, i = 0; (edges[stream][e] != 0) && (shift >= 0); shift -= 8, i++)
+                encodedBytes[words[e] * 8 + i] |= uint8_t(edges[stream][e] >> shift);
+    }
+
+    encodedSize = byteCount;
+
     return true;
-}
\ No newline at end of file
+}
+
+/*
+* builds the decode lookup table. Every leaf within DECODE_TABLE_BITS of the root fills
+* all the table slots that start with its code, so one lookup on the next
+* DECODE_TABLE_BITS of input gives us the symbol and how many bits it used. Anything
+* deeper gets the subtree at DECODE_TABLE_BITS and we finish it off a bit at a time.
+*
+* @param    root                root of the huffman tree
+* @param    table               lookup table, (1 << DECODE_TABLE_BITS) entries
+*
+* @return   none
+*/
+void buildDecodeTable(const HuffmanTree& tree, std::vector<DecodeEntry>& table)
+{
+    table.assign(size_t(1) << DECODE_TABLE_BITS, { NO_NODE, 0, 0 });
+
+    struct Pending { int16_t node; uint32_t code; uint8_t depth; };
+    std::array<Pending, MAX_TREE_NODES> stack;
+    size_t top = 0;
+    stack[top++] = { tree.root, 0, 0 };
+
+    while (top > 0)
+    {
+        Pending current = stack[--top];
+        const Node& node = tree.nodes[current.node];
+
+        bool leaf = tree.isLeaf(current.node);
+        if (leaf || current.depth == DECODE_TABLE_BITS)
+        {
+            uint8_t shift = DECODE_TABLE_BITS - current.depth;
+            size_t first = size_t(current.code) << shift;
+            DecodeEntry entry = leaf
+                ? DecodeEntry{ NO_NODE, node.ch, current.depth }
+                : DecodeEntry{ current.node, 0, 0 };
+
+            std::fill(table.begin() + first, table.begin() + first + (size_t(1) << shift), entry);
+            continue;
+        }
+
+        stack[top++] = { node.left, current.code << 1, uint8_t(current.depth + 1) };
+        stack[top++] = { node.right, (current.code << 1) | 1, uint8_t(current.depth + 1) };
+    }
+}
+
+/*
+* Reads one stream of packed huffman bits. Bits are pulled into a 64 bit buffer most
+* significant bit first and we resolve up to DECODE_TABLE_BITS per lookup. Past the end
+* of the input we just feed in zeros, we stop on symbol count anyway.
+*/
+struct StreamDecoder
+{
+    const uint8_t* packed;
+    size_t packedSize;
+    uint8_t* out;
+    uint8_t* end;
+
+    size_t next = 0;
+    uint64_t buffer = 0;
+    uint32_t count = 0;
+    uint64_t consumed = 0;
+
+    void refill()
+    {
+        while (count <= 56)
+        {
+            uint8_t byte = (next < packedSize) ? packed[next] : 0;
+            next++;
+            buffer |= uint64_t(byte) << (56 - count);
+            count += 8;
+        }
+    }
+
+    void decodeSymbol(const HuffmanTree& tree, const std::vector<DecodeEntry>& table)
+    {
+        refill();
+
+        const DecodeEntry& entry = table[buffer >> (64 - DECODE_TABLE_BITS)];
+        if (entry.length != 0)
+        {
+            *out++ = entry.symbol;
+            buffer <<= entry.length;
+            count -= entry.length;
+            consumed += entry.length;
+            return;
+        }
+
+        buffer <<= DECODE_TABLE_BITS;
+        count -= DECODE_TABLE_BITS;
+        consumed += DECODE_TABLE_BITS;
+
+        int16_t curr = entry.subtree;
+        while (!tree.isLeaf(curr))
+        {
+            if (count == 0)
+                refill();
+
+            curr = (buffer >> 63) ? tree.nodes[curr].right : tree.nodes[curr].left;
+            buffer <<= 1;
+            count--;
+            consumed++;
+        }
+
+        *out++ = tree.nodes[curr].ch;
+    }
+};
+
+// streams one thread steps through side by side, so their lookups overlap
+constexpr size_t INTERLEAVED_STREAMS = 4;
+
+/*
+* Decodes packed huffman bits, straight off the rubix array into the caller's buffer.
+*
+* @param    tree                huffman tree, from the frequency map or the code lengths
+* @param    symbolCount         number of bytes to decode
+* @param    packed              packed huffman bits
+* @param    packedSize          number of bytes in packed
+* @param    stringLength        number of valid bits
+* @param    decodedBytes        decoded output
+* @param    capacity            size of decodedBytes
+*
+* @return   bool                false if the bits don't line up with the symbol count
+*/
+bool huffmanDecode(const HuffmanTree& tree, uint32_t symbolCount, const uint8_t* packed, size_t packedSize, uint32_t stringLength, uint8_t* decodedBytes, size_t capacity)
+{
+    // anything bigger than this can't have come from us, most likely the wrong key
+    if ((symbolCount > SIXTEEN_MEGABYTES) || (symbolCount > capacity) || (stringLength > uint64_t(packedSize) * 8))
+        return false;
+
+    std::vector<DecodeEntry> table;
+    buildDecodeTable(tree, table);
+
+    StreamDecoder stream{ packed, packedSize, decodedBytes, decodedBytes + symbolCount };
+
+    while (stream.out < stream.end)
+        stream.decodeSymbol(tree, table);
+
+    return stream.consumed == stringLength;
+}
+
+/*
+* Decodes a payload split into independent streams, see huffmanEncode. Each thread
+* takes a run of streams and steps through INTERLEAVED_STREAMS of them at a time, one
+* symbol from each in turn, so the table lookups of one stream don't wait on the
+* previous symbol of another.
+*
+* @param    tree                canonical huffman tree
+* @param    symbolCount         number of bytes to decode across all the streams
+* @param    packed              packed huffman streams, back to back
+* @param    packedSize          number of bytes in packed
+* @param    streamBits          number of valid bits in each stream
+* @param    decodedBytes        decoded output
+* @param    capacity            size of decodedBytes
+* @param    pool                threads to split the streams across
+*
+* @return   bool                false if the bits don't line up with the symbol count
+*/
+bool huffmanDecodeStreams(const HuffmanTree& tree, uint32_t symbolCount, const uint8_t* packed, size_t packedSize,
+    const std::vector<uint32_t>& streamBits, uint8_t* decodedBytes, size_t capacity, ThreadPool& pool)
+{
+    const size_t streamCount = streamBits.size();
+    if ((symbolCount > SIXTEEN_MEGABYTES) || (symbolCount > capacity) || (streamCount == 0) || (streamCount > MAX_HUFFMAN_STREAMS))
+        return false;
+
+    std::vector<size_t> firstByte(streamCount + 1, 0);
+    for (size_t stream = 0; stream < streamCount; stream++)
+        firstByte[stream + 1] = firstByte[stream] + (size_t(streamBits[stream]) + 7) / 8;
+
+    if (firstByte[streamCount] > packedSize)
+        return false;
+
+    std::vector<DecodeEntry> table;
+    buildDecodeTable(tree, table);
+
+    std::vector<StreamDecoder> streams;
+    for (size_t stream = 0; stream < streamCount; stream++)
+        streams.push_back({ packed + firstByte[stream], firstByte[stream + 1] - firstByte[stream],
+            decodedBytes + streamStart(symbolCount, stream, streamCount),
+            decodedBytes + streamStart(symbolCount, stream + 1, streamCount) });
+
+    pool.parallelFor(streamCount, [&](size_t firstStream, size_t lastStream)
+    {
+        for (size_t group = firstStream; group < lastStream; group += INTERLEAVED_STREAMS)
+        {
+            StreamDecoder* lanes = streams.data() + group;
+            size_t laneCount = std::min(INTERLEAVED_STREAMS, lastStream - group);
+
+            // every lane has at least this many symbols left, so no end checks inside
+            size_t together = SIXTEEN_MEGABYTES;
+            for (size_t lane = 0; lane < laneCount; lane++)
+                together = std::min(together, size_t(lanes[lane].end - lanes[lane].out));
+
+            for (size_t n = 0; n < together; n++)
+                for (size_t lane = 0; lane < laneCount; lane++)
+                    lanes[lane].decodeSymbol(tree, table);
+
+            for (size_t lane = 0; lane < laneCount; lane++)
+                while (lanes[lane].out < lanes[lane].end)
+                    lanes[lane].decodeSymbol(tree, table);
+        }
+    });
+
+    for (size_t stream = 0; stream < streamCount; stream++)
+        if (streams[stream].consumed != streamBits[stream])
+            return false;
+
+    return true;
+}
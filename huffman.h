@@ -1,19 +1,73 @@
 #pragma once
 #include "file_encryptor.h"
 #include <array>
-#include <bitset>
 
-// Structure to represent a node in the Huffman tree
+// Structure to represent a node in the Huffman tree, children are indexes into
+// HuffmanTree::nodes, NO_NODE for a leaf
 struct Node
 {
-    char ch;
-    int freq;
-    Node* left, * right;
+    uint32_t freq;
+    int16_t left, right;
+    uint8_t ch;
+};
+
+constexpr int16_t NO_NODE = -1;
+
+// 256 leaves plus 255 internal nodes is as big as a tree over bytes can get
+constexpr uint16_t MAX_TREE_NODES = 511;
+
+// The whole tree lives in one fixed array, nothing to free when it goes out of scope
+struct HuffmanTree
+{
+    std::array<Node, MAX_TREE_NODES> nodes;
+    uint16_t count = 0;
+    int16_t root = NO_NODE;
+
+    bool isLeaf(int16_t index) const { return nodes[index].left == NO_NODE; }
+};
+
+// Flat per-symbol code table entry, the code is right aligned in 'bits'
+struct HuffmanCode
+{
+    uint64_t bits;
+    uint8_t length;
+};
 
-    Node(char ch, int freq) : ch(ch), freq(freq), left(nullptr), right(nullptr) {}
+// longest code we can push through the 64 bit accumulator in one go
+constexpr uint8_t MAX_PACKED_CODE_LENGTH = 64;
+
+// Decode lookup table entry, indexed by the next DECODE_TABLE_BITS bits of input.
+// length 0 means the code is longer than the table, keep walking from 'subtree'
+struct DecodeEntry
+{
+    int16_t subtree;
+    uint8_t symbol;
+    uint8_t length;
 };
 
-Node*   buildHuffmanTree(const std::array<int, 256>& freqMap);
-void    generateCodes(Node* root, std::string code, std::map<unsigned char, std::string>& codes);
-bool    huffmanEncode(std::vector<uint8_t>& input, std::array<uint32_t, 256>& freq, std::vector<uint8_t>& encodedBytes, uint32_t &stringLength);
-bool    huffmanDecode(std::string& input, std::array<uint32_t, 256>& freq, std::vector<uint8_t>& decodedBytes);
+constexpr uint8_t DECODE_TABLE_BITS = 11;
+
+// the encoder always writes this many streams, whatever the thread count, so the output
+// doesn't depend on the machine. The decoder takes anything up to MAX_HUFFMAN_STREAMS
+constexpr uint8_t HUFFMAN_STREAMS = 16;
+
+// above this many bits of entropy per byte, counted before the XOR, the input is stored as
+// is, Huffman would save well under 1% and still cost a full pass to pack and another to unpack
+constexpr double STORE_ENTROPY_BITS = 7.95;
+
+// byte counts are spread over this many tables, see countBytes
+constexpr uint8_t COUNT_TABLES = 4;
+
+bool    buildCanonicalCodes(const std::array<uint8_t, 256>& lengths, std::array<HuffmanCode, 256>& table);
+bool    buildCanonicalTree(const std::array<uint8_t, 256>& lengths, HuffmanTree& tree);
+bool    buildCodeLengths(const std::array<uint32_t, 256>& freq, std::array<uint8_t, 256>& lengths);
+void    buildDecodeTable(const HuffmanTree& tree, std::vector<DecodeEntry>& table);
+void    buildHuffmanTree(const std::array<uint32_t, 256>& freqMap, HuffmanTree& tree);
+double  byteEntropy(const std::array<uint32_t, 256>& freq);
+void    countBytes(const uint8_t* input, size_t length, std::array<uint32_t, 256>& counts);
+bool    huffmanEncode(const uint8_t* input, size_t inputSize, std::array<uint8_t, 256>& lengths, uint8_t* encodedBytes, size_t capacity, size_t& encodedSize, std::vector<uint32_t>& streamBits, bool store, ThreadPool& pool);
+bool    huffmanEncode(const uint8_t* input, size_t inputSize, const std::vector<std::array<uint32_t, 256>>& streamFreq, std::array<uint8_t, 256>& lengths, uint8_t* encodedBytes, size_t capacity, size_t& encodedSize, std::vector<uint32_t>& streamBits, bool store, ThreadPool& pool);
+bool    huffmanDecode(const HuffmanTree& tree, uint32_t symbolCount, const uint8_t* packed, size_t packedSize, uint32_t stringLength, uint8_t* decodedBytes, size_t capacity);
+bool    huffmanDecodeStreams(const HuffmanTree& tree, uint32_t symbolCount, const uint8_t* packed, size_t packedSize, const std::vector<uint32_t>& streamBits, uint8_t* decodedBytes, size_t capacity, ThreadPool& pool);
+bool    incompressible(const std::vector<std::array<uint32_t, 256>>& plainFreq);
+size_t  streamStart(size_t symbolCount, size_t stream, size_t streamCount);
@@ -0,0 +1,33 @@
+/*
+ * key_schedule.cpp
+ *
+ * Building the schedule is all the per key work there is, so it's done once rather than
+ * for every cube: padding the key out for XOR, pulling the shift tables out of it and
+ * looking up the prime.
+ */
+#include "key_schedule.h"
+
+/*
+ * This function prepares the key (see prepareKey) and works out everything the stages
+ * need from it.
+ *
+ * @param key                       the key as given, at least MIN_KEY_SIZE bytes
+ * @param schedule                  key tables to fill in
+ *
+ * @return                          false if the key is too short
+ */
+bool buildKeySchedule(const std::vector<uint8_t>& key, KeySchedule& schedule)
+{
+    schedule.key = key;
+    if (prepareKey(schedule.key) == false)
+        return false;
+
+    buildKeyPad(schedule.key, schedule.pad);
+    schedule.xorKernel = selectXorKernel();
+    getRubixShifts(schedule.key, schedule.shifts);
+
+    // the 59th byte of the key picks the prime, see getPrime
+    schedule.prime = getPrime(schedule.key[59]);
+
+    return true;
+}
@@ -0,0 +1,23 @@
+/*
+ * key_schedule.h
+ * This file contains the KeySchedule, everything the stages take from the key worked out
+ * once up front: the key pad for XOR, the Rubix shift tables and the prime for the final
+ * shuffle. One schedule does for every file and every cube encrypted with that key.
+ *
+*/
+#pragma once
+#include "file_encryptor.h"
+#include "rubix.h"
+#include "xor_kernel.h"
+
+struct KeySchedule
+{
+    std::vector<uint8_t> key;           // prepared key, MAX_KEY_SIZE bytes, see prepareKey
+    std::vector<uint8_t> pad;           // the key laid end to end, see buildKeyPad
+    XorFunction xorKernel = nullptr;    // fastest XOR kernel the CPU has
+    bool fusedCount = true;             // count the bytes for Huffman as they're XORed, false for a pass each (same output)
+    RubixShifts shifts{};               // Rubix shift tables
+    uint32_t prime = 0;                 // prime for the final shuffle
+};
+
+bool	buildKeySchedule(const std::vector<uint8_t>& key, KeySchedule& schedule);
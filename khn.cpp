@@ -0,0 +1,187 @@
+/*
+ * khn.cpp
+ *
+ * The same stages as the command line, encodeCube and decodeCube, run over a buffer
+ * the caller hands us. Big buffers are cut into blocks the way encodeStream does, a
+ * block at a time through the one arena.
+ */
+#include "khn.h"
+#include "padding.h"
+
+namespace khn
+{
+
+/*
+ * This function turns a Status into something to tell the user.
+ *
+ * @param status                    what a Context call returned
+ *
+ * @return                          message
+ */
+const char* statusMessage(Status status)
+{
+    switch (status)
+    {
+        case Status::OK:                return "OK.";
+        case Status::BAD_KEY:           return "Key must be at least 64 bytes.";
+        case Status::BAD_INPUT:         return "Input isn't the size of anything we encrypt.";
+        case Status::BAD_HEADER:        return "Error with file header.";
+        case Status::HUFFMAN_ERROR:     return "Error with huffman encoding";
+        case Status::UNKNOWN_VERSION:   return "Unknown file version.";
+    }
+
+    return "Unknown error.";
+}
+
+/*
+ * This function maps what went wrong inside a cube onto our Status.
+ *
+ * @param status                    what encodeCube or decodeCube returned
+ *
+ * @return                          the matching Status
+ */
+static Status fromCubeStatus(CubeStatus status)
+{
+    switch (status)
+    {
+        case CubeStatus::OK:                return Status::OK;
+        case CubeStatus::BAD_HEADER:        return Status::BAD_HEADER;
+        case CubeStatus::HUFFMAN_ERROR:     return Status::HUFFMAN_ERROR;
+        case CubeStatus::UNKNOWN_VERSION:   return Status::UNKNOWN_VERSION;
+        case CubeStatus::BAD_CUBE_SIZE:     return Status::BAD_INPUT;
+    }
+
+    return Status::BAD_INPUT;
+}
+
+/*
+ * This function works out the key schedule once for every call, see buildKeySchedule.
+ *
+ * @param key                       key bytes, at least MIN_KEY_SIZE of them
+ * @param threads                   threads to split each cube's stages across
+ */
+Context::Context(std::span<const uint8_t> key, unsigned threads)
+    : pool(std::clamp(threads, 1u, MAX_THREADS))
+{
+    if (buildKeySchedule(std::vector<uint8_t>(key.begin(), key.end()), schedule) == false)
+        keyStatus = Status::BAD_KEY;
+}
+
+/*
+ * This function encrypts a buffer. Up to 12MB is one cube, as small as it fits in,
+ * anything bigger is a 16MB cube for every 12MB block, like a streamed file.
+ *
+ * @param input                     bytes to encrypt
+ * @param output                    the encrypted bytes, sized here
+ * @param name                      stored in the header, handed back by decrypt
+ *
+ * @return                          OK, or what went wrong
+ */
+Status Context::encrypt(std::span<const uint8_t> input, std::vector<uint8_t>& output, const std::string& name)
+{
+    output.clear();
+    if (keyStatus != Status::OK)
+        return keyStatus;
+
+    MappedFile view;
+    view.wrap(input.data(), input.size());
+
+    std::vector<uint8_t> header, noHeader;
+    buildHeader(name, input.size(), header);
+
+    uint64_t blockCount = (input.size() > TWELVE_MEGABYTES) ? (input.size() + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE : 1;
+    uint32_t side = (blockCount > 1) ? RUBIX_SIDE_SIZE : 0;
+    uint64_t paddingStream = reservePaddingStreams(1);
+    output.reserve(size_t(blockCount * SIXTEEN_MEGABYTES));
+
+    for (uint64_t block = 0; block < blockCount; block++)
+    {
+        uint64_t offset = block * STREAM_BLOCK_SIZE;
+        size_t length = size_t(std::min<uint64_t>(STREAM_BLOCK_SIZE, input.size() - offset));
+
+        CubeStatus status = encodeCube((block == 0) ? header : noHeader, view, offset, length, side, paddingStream, schedule, arena, pool, false, false);
+        if (status != CubeStatus::OK)
+        {
+            output.clear();
+            return fromCubeStatus(status);
+        }
+
+        output.insert(output.end(), arena.cube.begin(), arena.cube.end());
+    }
+
+    return Status::OK;
+}
+
+/*
+ * This function decrypts what encrypt (or the command line) wrote. The header in the
+ * first cube tells us the size and name, and for more than one cube, how many there
+ * should be.
+ *
+ * @param input                     bytes to decrypt, one cube or a whole number of 16MB ones
+ * @param output                    the decrypted bytes, sized here
+ * @param name                      if not null, gets the name from the header
+ *
+ * @return                          OK, or what went wrong
+ */
+Status Context::decrypt(std::span<const uint8_t> input, std::vector<uint8_t>& output, std::string* name)
+{
+    output.clear();
+    if (keyStatus != Status::OK)
+        return keyStatus;
+
+    // one cube of any size, or a stream of full size ones
+    uint32_t side = (input.size() > SIXTEEN_MEGABYTES) ? RUBIX_SIDE_SIZE : cubeSideOf(input.size());
+    uint64_t cubeSize = uint64_t(side) * side * side;
+    if ((side == 0) || (input.size() % cubeSize != 0))
+        return Status::BAD_INPUT;
+
+    MappedFile view;
+    view.wrap(input.data(), input.size());
+
+    uint64_t blockCount = input.size() / cubeSize;
+    FileHeader header;
+
+    for (uint64_t block = 0; block < blockCount; block++)
+    {
+        size_t decodedSize = 0;
+        CubeStatus status = decodeCube(view, block * cubeSize, side, schedule, arena, decodedSize, pool, false, false);
+        if (status != CubeStatus::OK)
+        {
+            output.clear();
+            return fromCubeStatus(status);
+        }
+
+        const uint8_t* bytes = arena.plain.data();
+        size_t start = 0;
+
+        // the first block has the header, see buildHeader
+        if (block == 0)
+        {
+            if ((readHeader(bytes, decodedSize, header) == false) || (header.streamed != (blockCount > 1))
+                || (header.streamed && ((header.fileSize + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE != blockCount)))
+            {
+                return Status::BAD_HEADER;
+            }
+
+            if (name != nullptr)
+                *name = header.fileName;
+
+            start = header.size;
+            output.reserve(size_t(header.fileSize));
+        }
+
+        // a single cube can have padding after the file, every block of a stream but the last is full
+        size_t count = size_t(std::min<uint64_t>(decodedSize - start, header.fileSize - output.size()));
+        if (header.streamed && (count != std::min<uint64_t>(STREAM_BLOCK_SIZE, header.fileSize - output.size())))
+        {
+            output.clear();
+            return Status::BAD_HEADER;
+        }
+
+        output.insert(output.end(), bytes + start, bytes + start + count);
+    }
+
+    return Status::OK;
+}
+
+}
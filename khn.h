@@ -0,0 +1,56 @@
+/*
+ * khn.h
+ * This file contains libkhn, the encoder and decoder working on buffers in memory rather
+ * than files, for linking into other programs. Nothing in here prints, exits or touches
+ * a file, errors come back as a Status.
+ *
+ * A Context holds a key schedule and the buffers a cube is worked in, so after it's
+ * made it doesn't allocate anything big apart from the output. Contexts don't share
+ * anything, so one per thread can be called from as many threads as you like.
+ *
+ * The bytes are exactly what file_encryptor reads and writes, a buffer encrypted here
+ * decodes with the command line and the other way round.
+ *
+*/
+#pragma once
+#include "file_encryptor.h"
+#include "key_schedule.h"
+#include <span>
+
+namespace khn
+{
+    enum class Status : uint8_t
+    {
+        OK,
+        BAD_KEY,            // shorter than MIN_KEY_SIZE
+        BAD_INPUT,          // not one cube or a whole number of full ones, so not something we encrypted
+        BAD_HEADER,         // the file size and name don't add up, most likely the wrong key
+        HUFFMAN_ERROR,      // the Huffman bits don't decode, most likely the wrong key
+        UNKNOWN_VERSION,    // metadata we didn't write, most likely the wrong key
+    };
+
+    const char* statusMessage(Status status);
+
+    class Context
+    {
+    public:
+        // threads (1 to MAX_THREADS) split up the stages of each cube
+        explicit Context(std::span<const uint8_t> key, unsigned threads = 1);
+
+        Context(const Context&) = delete;
+        Context& operator=(const Context&) = delete;
+
+        // BAD_KEY if the key can't be used, every call returns it too
+        Status status() const { return keyStatus; }
+
+        // name goes in the header the way a file name does, it can be left empty
+        Status encrypt(std::span<const uint8_t> input, std::vector<uint8_t>& output, const std::string& name = "");
+        Status decrypt(std::span<const uint8_t> input, std::vector<uint8_t>& output, std::string* name = nullptr);
+
+    private:
+        KeySchedule schedule;
+        Status keyStatus = Status::OK;
+        ThreadPool pool;
+        CubeArena arena;
+    };
+}
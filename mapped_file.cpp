@@ -0,0 +1,190 @@
+/*
+ * mapped_file.cpp
+ *
+ * The whole file is mapped read only in one go and read front to back, so the kernel is
+ * told it's sequential. Callers hint each range before they need it and give it back
+ * once they're done, so a big file streamed through a block at a time only ever has a
+ * few blocks of it resident.
+ */
+#include "mapped_file.h"
+#include <algorithm>
+
+#if MAPPED_FILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+/*
+ * This function unmaps the file if it's still open.
+ */
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+/*
+ * This function opens the file and maps it. An empty file is fine, there's just nothing
+ * to map.
+ *
+ * @param fileName                  name of the file to open
+ *
+ * @return                          false if the file can't be opened or mapped
+ */
+bool MappedFile::open(const std::string& fileName)
+{
+    close();
+
+#if MAPPED_FILE_MMAP
+    int descriptor = ::open(fileName.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return false;
+
+    struct stat status;
+    if ((fstat(descriptor, &status) != 0) || !S_ISREG(status.st_mode))
+    {
+        ::close(descriptor);
+        return false;
+    }
+
+    length = uint64_t(status.st_size);
+    if (length > 0)
+    {
+        void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapping == MAP_FAILED)
+        {
+            ::close(descriptor);
+            length = 0;
+            return false;
+        }
+
+        view = static_cast<const uint8_t*>(mapping);
+        mapped = true;
+        madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+
+    // the mapping keeps its own reference to the file
+    ::close(descriptor);
+#else
+    std::ifstream input(fileName, std::ifstream::ate | std::ios::binary);
+    if (!input.is_open())
+        return false;
+
+    length = uint64_t(input.tellg());
+    input.seekg(0);
+
+    buffer.resize(size_t(length));
+    if (!input.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(length)))
+    {
+        buffer.clear();
+        length = 0;
+        return false;
+    }
+
+    view = buffer.data();
+#endif
+
+    return true;
+}
+
+/*
+ * This function views a buffer the caller owns. It has to outlive us, and the hints
+ * leave it alone, it isn't ours to give back.
+ *
+ * @param data                      start of the buffer
+ * @param size                      size of the buffer
+ *
+ * @return                          void
+ */
+void MappedFile::wrap(const uint8_t* data, uint64_t size)
+{
+    close();
+
+    view = data;
+    length = size;
+}
+
+/*
+ * This function unmaps the file.
+ */
+void MappedFile::close()
+{
+#if MAPPED_FILE_MMAP
+    if (mapped)
+        munmap(const_cast<uint8_t*>(view), length);
+#else
+    std::vector<uint8_t>().swap(buffer);
+#endif
+
+    view = nullptr;
+    length = 0;
+    mapped = false;
+}
+
+#if MAPPED_FILE_MMAP
+/*
+ * This function runs madvise over whole pages covering a range of the file.
+ *
+ * @param view                      start of the mapping
+ * @param length                    size of the mapping
+ * @param offset                    start of the range
+ * @param count                     size of the range
+ * @param advice                    MADV_ value
+ *
+ * @return                          void
+ */
+static void adviseRange(const uint8_t* view, uint64_t length, uint64_t offset, uint64_t count, int advice)
+{
+    static const uint64_t pageSize = uint64_t(sysconf(_SC_PAGESIZE));
+
+    if ((view == nullptr) || (offset >= length))
+        return;
+
+    uint64_t first = offset - (offset % pageSize);
+    uint64_t last = std::min(length, offset + count);
+
+    madvise(const_cast<uint8_t*>(view) + first, last - first, advice);
+}
+#endif
+
+/*
+ * This function tells the kernel to start reading a range in, we'll want it soon.
+ *
+ * @param offset                    start of the range
+ * @param count                     size of the range
+ *
+ * @return                          void
+ */
+void MappedFile::prefetch(uint64_t offset, uint64_t count) const
+{
+#if MAPPED_FILE_MMAP
+    if (mapped)
+        adviseRange(view, length, offset, count, MADV_WILLNEED);
+#else
+    (void)offset;
+    (void)count;
+#endif
+}
+
+/*
+ * This function drops a range we're done with. The pages are still in the page cache,
+ * they just stop counting against us, and reading them again would fault them back in.
+ *
+ * @param offset                    start of the range
+ * @param count                     size of the range
+ *
+ * @return                          void
+ */
+void MappedFile::release(uint64_t offset, uint64_t count) const
+{
+#if MAPPED_FILE_MMAP
+    if (mapped)
+        adviseRange(view, length, offset, count, MADV_DONTNEED);
+#else
+    (void)offset;
+    (void)count;
+#endif
+}
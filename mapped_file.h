@@ -0,0 +1,50 @@
+/*
+ * mapped_file.h
+ * This file contains a read only view of an input file. On Linux (and anything else with
+ * mmap) the file is mapped straight into memory, so the stages read it out of the page
+ * cache rather than out of a copy. Everywhere else it's read into a buffer. It can also
+ * view a buffer the caller already has, see libkhn.
+ *
+*/
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPED_FILE_MMAP 1
+#else
+#define MAPPED_FILE_MMAP 0
+#endif
+
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& fileName);
+    void close();
+
+    // views bytes that are already in memory, for callers with a buffer rather than a file
+    void wrap(const uint8_t* data, uint64_t size);
+
+    const uint8_t* data() const { return view; }
+    uint64_t size() const { return length; }
+
+    // hints that [offset, offset + count) is about to be read / has been read
+    void prefetch(uint64_t offset, uint64_t count) const;
+    void release(uint64_t offset, uint64_t count) const;
+
+private:
+    const uint8_t* view = nullptr;
+    uint64_t length = 0;
+    bool mapped = false;
+
+#if !MAPPED_FILE_MMAP
+    std::vector<uint8_t> buffer;
+#endif
+};
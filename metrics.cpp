@@ -0,0 +1,428 @@
+/*
+ * metrics.cpp
+ *
+ * Every stage adds its numbers to one set of totals per direction, under a lock, once
+ * per cube, so the lock is taken a handful of times per 16MB and doesn't show.
+ *
+ * The hardware counters are opened per thread (a counter only counts the thread that
+ * opened it), on every pool thread when metrics are turned on and on any other thread
+ * the first time it times a stage, and closed when the thread exits. A stage measured
+ * across the whole process adds up every thread's counters, and keeps what the threads
+ * that have exited got to. They're user space only, and if the kernel won't give us a
+ * counter (perf_event_paranoid, a VM without a PMU) it's reported as null.
+ */
+#include "metrics.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if METRICS_POSIX
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
+// running totals for one stage
+struct StageTotals
+{
+    uint64_t calls = 0;
+    double wallSeconds = 0;
+    double cpuSeconds = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t counters[METRIC_COUNTERS] = {};
+};
+
+static std::atomic<bool> enabled{ false };
+static bool countersWanted = false;
+static std::atomic<bool> countersOpened[METRIC_COUNTERS];
+static double runStart = 0;
+static double runCpuStart = 0;
+
+static std::mutex totalsMutex;
+static StageTotals totals[2][STAGE_END];
+
+// one thread's counters, closed when the thread exits
+struct ThreadCounters
+{
+    bool open = false;
+    std::array<int, METRIC_COUNTERS> fds = { -1, -1, -1, -1 };
+
+    ~ThreadCounters();
+};
+
+// every live thread's counters, so a whole process stage can add them up, plus what
+// the threads that have exited had counted, so the sum never goes backwards
+static std::mutex countersMutex;
+static std::vector<const ThreadCounters*> threadCounters;
+static uint64_t exitedCounts[METRIC_COUNTERS] = {};
+thread_local ThreadCounters myCounters;
+
+static const char* COUNTER_NAMES[METRIC_COUNTERS] = { "cycles", "instructions", "llc_misses", "dtlb_misses" };
+static const char* ENCODE_STAGE_NAMES[STAGE_END] = { "xor", "huffman", "rubix", "shuffle", "write" };
+static const char* DECODE_STAGE_NAMES[STAGE_END] = { "shuffle", "rubix", "huffman", "xor", "write" };
+
+/*
+ * This function reads the wall clock.
+ *
+ * @param   none
+ * @return  double                  seconds since some fixed point
+ */
+static double wallSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * This function reads the CPU time, user and system, of this thread or the whole process.
+ *
+ * @param wholeProcess              every thread rather than just this one
+ *
+ * @return                          seconds
+ */
+static double cpuSeconds(bool wholeProcess)
+{
+#if METRICS_POSIX
+    timespec now;
+    if (clock_gettime(wholeProcess ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID, &now) != 0)
+        return 0;
+
+    return double(now.tv_sec) + double(now.tv_nsec) / 1e9;
+#else
+    FILETIME created, exited, kernel, user;
+    BOOL ok = wholeProcess ? GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)
+                           : GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user);
+    if (!ok)
+        return 0;
+
+    auto ticks = [](const FILETIME& time) { return (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+    return double(ticks(kernel) + ticks(user)) / 1e7;
+#endif
+}
+
+/*
+ * This function reads the most memory the process has had resident.
+ *
+ * @param   none
+ * @return  uint64_t                peak RSS in KB
+ */
+static uint64_t peakRssKB()
+{
+#if METRICS_POSIX
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+#if defined(__APPLE__)
+    return uint64_t(usage.ru_maxrss) / 1024;
+#else
+    return uint64_t(usage.ru_maxrss);
+#endif
+#else
+    PROCESS_MEMORY_COUNTERS memory;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)))
+        return 0;
+
+    return uint64_t(memory.PeakWorkingSetSize) / 1024;
+#endif
+}
+
+/*
+ * This function opens the hardware counters for the calling thread, if we want them
+ * and haven't already.
+ *
+ * @param   none
+ * @return  void
+ */
+static void openThreadCounters()
+{
+    if (myCounters.open || !countersWanted)
+        return;
+
+    myCounters.open = true;
+
+#if defined(__linux__)
+    const uint32_t types[METRIC_COUNTERS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+    const uint64_t configs[METRIC_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    };
+
+    for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+    {
+        perf_event_attr attr = {};
+        attr.type = types[i];
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // this thread, any CPU
+        myCounters.fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (myCounters.fds[i] >= 0)
+            countersOpened[i] = true;
+    }
+#endif
+
+    std::lock_guard<std::mutex> lock(countersMutex);
+    threadCounters.push_back(&myCounters);
+}
+
+/*
+ * This function reads one counter.
+ *
+ * @param fd                        counter from perf_event_open, -1 if we don't have it
+ *
+ * @return                          count so far, 0 if we don't have it
+ */
+static uint64_t readCounter(int fd)
+{
+    uint64_t value = 0;
+#if defined(__linux__)
+    if ((fd < 0) || (read(fd, &value, sizeof(value)) != ssize_t(sizeof(value))))
+        return 0;
+#else
+    (void)fd;
+#endif
+    return value;
+}
+
+/*
+ * This destructor runs as the thread exits. It keeps what the thread's counters got
+ * to, takes them out of the list and closes them.
+ *
+ * @param   none
+ * @return  none
+ */
+ThreadCounters::~ThreadCounters()
+{
+    if (!open)
+        return;
+
+    std::lock_guard<std::mutex> lock(countersMutex);
+    for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+        exitedCounts[i] += readCounter(fds[i]);
+    threadCounters.erase(std::remove(threadCounters.begin(), threadCounters.end(), this), threadCounters.end());
+
+#if defined(__linux__)
+    for (int& fd : fds)
+    {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+/*
+ * This function reads the hardware counters, of this thread or added up over every
+ * thread that has them.
+ *
+ * @param wholeProcess              every thread rather than just this one
+ * @param values                    counts so far
+ *
+ * @return                          void
+ */
+static void readCounters(bool wholeProcess, uint64_t values[METRIC_COUNTERS])
+{
+    for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+        values[i] = 0;
+
+    if (!countersWanted)
+        return;
+
+    if (!wholeProcess)
+    {
+        for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+            values[i] = readCounter(myCounters.fds[i]);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(countersMutex);
+    for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+        values[i] = exitedCounts[i];
+    for (const ThreadCounters* counters : threadCounters)
+        for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+            values[i] += readCounter(counters->fds[i]);
+}
+
+/*
+ * This function turns metrics on for the rest of the run. With counters, every thread
+ * of the pool opens its hardware counters now, so a stage spread across the pool counts
+ * all of it.
+ *
+ * @param counters                  add the hardware counters, Linux only
+ * @param pool                      threads the stages will run on
+ *
+ * @return                          void
+ */
+void enableMetrics(bool counters, ThreadPool& pool)
+{
+    countersWanted = counters;
+
+    // one index per thread, so every thread in the pool opens its own
+    pool.parallelFor(pool.size(), [](size_t, size_t) { openThreadCounters(); });
+    openThreadCounters();
+
+    runStart = wallSeconds();
+    runCpuStart = cpuSeconds(true);
+    enabled = true;
+}
+
+/*
+ * This function tells us whether metrics are on.
+ *
+ * @param   none
+ * @return  bool                    true if enableMetrics() has been called
+ */
+bool metricsEnabled()
+{
+    return enabled;
+}
+
+/*
+ * This function sets up a timer for one cube or one file.
+ *
+ * @param encoding                  true for the encode stages, false for decode
+ * @param wholeProcess              the stages run across the whole pool, see StageTimer
+ */
+StageTimer::StageTimer(bool encoding, bool wholeProcess)
+    : encoding(encoding), wholeProcess(wholeProcess)
+{
+}
+
+/*
+ * This function starts timing a stage.
+ *
+ * @param stage                     stage, ENCODE_XOR to ENCODE_WRITE_OUT or DECODE_SHUFFLE to DECODE_WRITE_OUT
+ * @param bytesIn                   bytes the stage reads
+ *
+ * @return                          void
+ */
+void StageTimer::start(uint8_t stage, uint64_t bytesIn)
+{
+    if (!enabled || (stage >= STAGE_END))
+        return;
+
+    openThreadCounters();
+
+    this->stage = stage;
+    this->bytesIn = bytesIn;
+    readCounters(wholeProcess, countersStart);
+    cpuStart = cpuSeconds(wholeProcess);
+    wallStart = wallSeconds();
+}
+
+/*
+ * This function stops timing the stage and adds it to the totals.
+ *
+ * @param bytesOut                  bytes the stage wrote
+ *
+ * @return                          void
+ */
+void StageTimer::stop(uint64_t bytesOut)
+{
+    if (!enabled || (stage >= STAGE_END))
+        return;
+
+    double wall = wallSeconds() - wallStart;
+    double cpu = cpuSeconds(wholeProcess) - cpuStart;
+
+    uint64_t counters[METRIC_COUNTERS];
+    readCounters(wholeProcess, counters);
+
+    {
+        std::lock_guard<std::mutex> lock(totalsMutex);
+        StageTotals& total = totals[encoding ? 0 : 1][stage];
+
+        total.calls++;
+        total.wallSeconds += wall;
+        total.cpuSeconds += cpu;
+        total.bytesIn += bytesIn;
+        total.bytesOut += bytesOut;
+        for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+            total.counters[i] += counters[i] - countersStart[i];
+    }
+
+    stage = STAGE_END;
+}
+
+/*
+ * This function writes the metrics for the run as one line of JSON. MB/s is the bigger
+ * of the bytes in and out of a stage (the Rubix shift takes the Huffman bytes and turns
+ * out a whole cube) over the wall time spent in it, so for cubes worked side by side
+ * it's the rate of one thread.
+ *
+ * @param out                       where to write it
+ * @param encoding                  which direction's stages to report
+ * @param threads                   thread count, for the report
+ *
+ * @return                          void
+ */
+void writeMetricsJson(std::ostream& out, bool encoding, unsigned threads)
+{
+    if (!enabled)
+        return;
+
+    auto rate = [](uint64_t bytes, double seconds) { return (seconds > 0) ? (double(bytes) / ONE_MEGABYTE) / seconds : 0.0; };
+
+    std::lock_guard<std::mutex> lock(totalsMutex);
+    const char* const* names = encoding ? ENCODE_STAGE_NAMES : DECODE_STAGE_NAMES;
+
+    std::ios::fmtflags flags = out.flags();
+    out << std::fixed << std::setprecision(6)
+        << "{\"direction\":\"" << (encoding ? "encode" : "decode") << "\""
+        << ",\"threads\":" << threads
+        << ",\"wall_seconds\":" << wallSeconds() - runStart
+        << ",\"cpu_seconds\":" << cpuSeconds(true) - runCpuStart
+        << ",\"peak_rss_kb\":" << peakRssKB()
+        << ",\"stages\":[";
+
+    bool first = true;
+    for (uint8_t stage = 0; stage < STAGE_END; stage++)
+    {
+        const StageTotals& total = totals[encoding ? 0 : 1][stage];
+        if (total.calls == 0)
+            continue;
+
+        out << (first ? "" : ",")
+            << "{\"stage\":\"" << names[stage] << "\""
+            << ",\"calls\":" << total.calls
+            << ",\"wall_seconds\":" << total.wallSeconds
+            << ",\"cpu_seconds\":" << total.cpuSeconds
+            << ",\"bytes_in\":" << total.bytesIn
+            << ",\"bytes_out\":" << total.bytesOut
+            << ",\"mb_per_second\":" << std::setprecision(1) << rate(std::max(total.bytesIn, total.bytesOut), total.wallSeconds) << std::setprecision(6);
+
+        if (countersWanted)
+        {
+            for (uint8_t i = 0; i < METRIC_COUNTERS; i++)
+            {
+                out << ",\"" << COUNTER_NAMES[i] << "\":";
+                if (countersOpened[i])
+                    out << total.counters[i];
+                else
+                    out << "null";
+            }
+        }
+
+        out << "}";
+        first = false;
+    }
+
+    out << "]}" << std::endl;
+    out.flags(flags);
+}
@@ -0,0 +1,51 @@
+/*
+ * metrics.h
+ * This file contains the per stage metrics for --metrics=json: wall and CPU time, bytes
+ * in and out of every stage, summed over every cube of the run, and the peak RSS. On
+ * Linux it can add hardware counters for each stage from perf_event_open (cycles,
+ * instructions, last level cache misses and data TLB misses).
+ *
+ * Nothing is measured unless enableMetrics() is called, so the stages pay one check of
+ * a flag and nothing else.
+ *
+*/
+#pragma once
+#include "file_encryptor.h"
+#include "thread_pool.h"
+#include <ostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define METRICS_POSIX 1
+#else
+#define METRICS_POSIX 0
+#endif
+
+// the hardware counters we ask for, in the order they're reported
+constexpr uint8_t METRIC_COUNTERS = 4;
+
+/*
+ * Times one stage at a time, for one cube or one file. A stage running across the whole
+ * pool is measured across the whole process, a stage on one thread (a block of a stream
+ * or a file of a batch, where other cubes run alongside) is measured on that thread.
+ */
+class StageTimer
+{
+public:
+    StageTimer(bool encoding, bool wholeProcess);
+
+    void start(uint8_t stage, uint64_t bytesIn);
+    void stop(uint64_t bytesOut);
+
+private:
+    bool encoding;
+    bool wholeProcess;
+    uint8_t stage = STAGE_END;
+    uint64_t bytesIn = 0;
+    double wallStart = 0;
+    double cpuStart = 0;
+    uint64_t countersStart[METRIC_COUNTERS] = {};
+};
+
+void	enableMetrics(bool counters, ThreadPool& pool);
+bool	metricsEnabled();
+void	writeMetricsJson(std::ostream& out, bool encoding, unsigned threads);
@@ -0,0 +1,260 @@
+/*
+ * output_file.cpp
+ *
+ * Plain writes go straight from the caller's buffer with pwrite, as few and as big as
+ * we can. O_DIRECT writes have to come from aligned memory in whole blocks, so they're
+ * copied through an aligned staging buffer, the last block is padded out and the file
+ * is cut back to the real size when we close it.
+ */
+#include "output_file.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+#if OUTPUT_FILE_POSIX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * This function closes the file if it's still open.
+ */
+OutputFile::~OutputFile()
+{
+    close();
+}
+
+/*
+ * This function creates (or empties) the output file. If O_DIRECT isn't available, or
+ * the file system won't take it, we quietly fall back to normal writes.
+ *
+ * Exclusive creates the file only if it isn't there yet (O_EXCL), which the file system
+ * checks and creates in one step, so it holds against other processes writing the same
+ * name as well as our own threads.
+ *
+ * @param fileName                  name of the file to write
+ * @param expectedSize              final size of the file if we know it, 0 otherwise
+ * @param direct                    skip the page cache if we can
+ * @param exclusive                 fail with errno EEXIST rather than empty a file that's there
+ *
+ * @return                          false if the file can't be created
+ */
+bool OutputFile::open(const std::string& fileName, uint64_t expectedSize, bool direct, bool exclusive)
+{
+    close();
+    written = 0;
+
+#if OUTPUT_FILE_POSIX
+    int flags = O_WRONLY | O_CREAT | (exclusive ? O_EXCL : O_TRUNC);
+
+    descriptor = ::open(fileName.c_str(), flags, 0644);
+    if (descriptor < 0)
+        return false;
+
+#ifdef O_DIRECT
+    // the file is ours now, so open it again past the page cache if the file system lets us
+    if (direct)
+    {
+        int unbuffered = ::open(fileName.c_str(), O_WRONLY | O_DIRECT);
+        if (unbuffered >= 0)
+        {
+            ::close(descriptor);
+            descriptor = unbuffered;
+            this->direct = true;
+        }
+    }
+#else
+    (void)direct;
+#endif
+
+    if (this->direct)
+    {
+        staging = static_cast<uint8_t*>(std::aligned_alloc(DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE));
+        staged = 0;
+
+        if (staging == nullptr)
+        {
+            close();
+            return false;
+        }
+    }
+#else
+    (void)direct;
+
+    // no O_EXCL here, checking first is the best we can do
+    if (exclusive && std::filesystem::exists(fileName))
+    {
+        errno = EEXIST;
+        return false;
+    }
+
+    stream.open(fileName, std::ios::binary | std::ios::trunc);
+    if (!stream.is_open())
+        return false;
+#endif
+
+    preallocate(expectedSize);
+
+    return true;
+}
+
+/*
+ * This function reserves the space for the whole file up front, so the file system can
+ * lay it out in one go instead of growing it a write at a time. Only a hint, if the file
+ * system can't do it we just carry on.
+ *
+ * @param expectedSize              final size of the file
+ *
+ * @return                          void
+ */
+void OutputFile::preallocate(uint64_t expectedSize)
+{
+#if OUTPUT_FILE_POSIX && defined(__linux__)
+    if ((descriptor >= 0) && (expectedSize > 0))
+        (void)fallocate(descriptor, 0, 0, off_t(expectedSize));
+#else
+    (void)expectedSize;
+#endif
+}
+
+#if OUTPUT_FILE_POSIX
+/*
+ * This function writes all of a buffer at an offset, going round again for short writes.
+ *
+ * @param data                      bytes to write
+ * @param length                    number of bytes
+ * @param offset                    where in the file they go
+ *
+ * @return                          false if the write fails
+ */
+bool OutputFile::writeAt(const uint8_t* data, size_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t result = pwrite(descriptor, data, length, off_t(offset));
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        data += result;
+        length -= size_t(result);
+        offset += uint64_t(result);
+    }
+
+    return true;
+}
+
+/*
+ * This function writes out the staging buffer for O_DIRECT. Only the last one can be a
+ * partial block, it's padded with zeros to a whole block and close() trims the file.
+ *
+ * @param last                      true if this is the end of the file
+ *
+ * @return                          false if the write fails
+ */
+bool OutputFile::flushStaging(bool last)
+{
+    if (staged == 0)
+        return true;
+
+    size_t length = staged;
+    if (last)
+    {
+        length = (staged + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+        std::memset(staging + staged, 0, length - staged);
+    }
+
+    bool ok = writeAt(staging, length, written - staged);
+    staged = 0;
+
+    return ok;
+}
+#endif
+
+/*
+ * This function appends bytes to the file.
+ *
+ * @param data                      bytes to write
+ * @param length                    number of bytes
+ *
+ * @return                          false if the write fails
+ */
+bool OutputFile::write(const uint8_t* data, size_t length)
+{
+#if OUTPUT_FILE_POSIX
+    if (descriptor < 0)
+        return false;
+
+    if (!direct)
+    {
+        bool ok = writeAt(data, length, written);
+        written += length;
+        return ok;
+    }
+
+    while (length > 0)
+    {
+        size_t count = std::min(length, DIRECT_IO_BUFFER_SIZE - staged);
+        std::memcpy(staging + staged, data, count);
+
+        staged += count;
+        written += count;
+        data += count;
+        length -= count;
+
+        if ((staged == DIRECT_IO_BUFFER_SIZE) && (flushStaging(false) == false))
+            return false;
+    }
+
+    return true;
+#else
+    stream.write(reinterpret_cast<const char*>(data), std::streamsize(length));
+    written += length;
+    return bool(stream);
+#endif
+}
+
+/*
+ * This function finishes the file: the last O_DIRECT block goes out, and the file is
+ * cut to exactly what we wrote, which also gives back anything we preallocated and
+ * didn't use.
+ *
+ * @param   none
+ * @return  bool                    false if anything didn't make it to the file
+ */
+bool OutputFile::close()
+{
+    bool ok = true;
+
+#if OUTPUT_FILE_POSIX
+    if (descriptor >= 0)
+    {
+        if (direct)
+            ok = flushStaging(true);
+
+        ok = (ftruncate(descriptor, off_t(written)) == 0) && ok;
+        ok = (::close(descriptor) == 0) && ok;
+    }
+
+    std::free(staging);
+    staging = nullptr;
+    staged = 0;
+    descriptor = -1;
+    direct = false;
+#else
+    if (stream.is_open())
+    {
+        stream.close();
+        ok = !stream.fail();
+    }
+#endif
+
+    return ok;
+}
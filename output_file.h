@@ -0,0 +1,54 @@
+/*
+ * output_file.h
+ * This file contains the output side to go with MappedFile. Output goes out in big
+ * writes, the file is preallocated when we know how big it's going to be, and on Linux
+ * it can skip the page cache with O_DIRECT.
+ *
+*/
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define OUTPUT_FILE_POSIX 1
+#else
+#define OUTPUT_FILE_POSIX 0
+#endif
+
+// O_DIRECT wants the buffer, the file offset and the length all lined up to this
+constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// size of the aligned buffer we copy through for O_DIRECT
+constexpr size_t DIRECT_IO_BUFFER_SIZE = 1 << 20;
+
+class OutputFile
+{
+public:
+    OutputFile() = default;
+    ~OutputFile();
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    // expectedSize of 0 means we don't know yet, preallocate() can be called later. With
+    // exclusive, a file that's already there is left alone and open fails with errno EEXIST
+    bool open(const std::string& fileName, uint64_t expectedSize, bool direct, bool exclusive = false);
+    void preallocate(uint64_t expectedSize);
+    bool write(const uint8_t* data, size_t length);
+    bool close();
+
+private:
+#if OUTPUT_FILE_POSIX
+    bool writeAt(const uint8_t* data, size_t length, uint64_t offset);
+    bool flushStaging(bool last);
+
+    int descriptor = -1;
+    bool direct = false;
+    uint8_t* staging = nullptr;
+    size_t staged = 0;
+#else
+    std::ofstream stream;
+#endif
+    uint64_t written = 0;
+};
@@ -0,0 +1,402 @@
+/*
+ * padding.cpp
+ *
+ * addPadding used to make a new std::random_device and std::mt19937 for every cube and
+ * call uniform_int_distribution once per byte, keeping 8 bits of each 32 bit draw. Now
+ * the whole run of padding comes out of ChaCha20 in one go, 64 bytes a block, several
+ * blocks at a time with vectors.
+ *
+ * Where the padding comes from in the key stream only depends on where it's going: the
+ * file picks the nonce, the cube within the file and the block within the cube pick the
+ * counter. So the key stream is never used twice, threads don't need a lock between
+ * them, and the output doesn't depend on which thread pads first.
+ */
+#include "padding.h"
+#include <atomic>
+#include <cstring>
+
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PADDING_X86 1
+#include <immintrin.h>
+#include "xor_kernel.h"
+#ifdef _MSC_VER
+#define PADDING_TARGET(isa)
+#else
+#define PADDING_TARGET(isa) __attribute__((target(isa)))
+#endif
+#else
+#define PADDING_X86 0
+#endif
+
+// the ChaCha state for this process and the next file stream nobody has used yet
+static uint32_t chachaState[16];
+static std::atomic<uint64_t> nextStream{ 0 };
+static std::once_flag seeded;
+
+static inline uint32_t rotateLeft(uint32_t value, int count)
+{
+    return (value << count) | (value >> (32 - count));
+}
+
+#define CHACHA_QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = rotateLeft(d, 16); \
+    c += d; b ^= c; b = rotateLeft(b, 12); \
+    a += b; d ^= a; d = rotateLeft(d, 8);  \
+    c += d; b ^= c; b = rotateLeft(b, 7);
+
+/*
+ * This function sets up a ChaCha20 state: the constant, a 256 bit key, and a 64 bit
+ * nonce after the 64 bit block counter (the original layout, not the IETF one).
+ *
+ * @param key                       32 byte key
+ * @param nonce                     nonce
+ * @param state                     state to set up, the counter words are left at 0
+ *
+ * @return                          void
+ */
+void initChaChaState(const uint8_t key[32], uint64_t nonce, uint32_t state[16])
+{
+    // "expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+
+    for (int i = 0; i < 8; i++)
+        state[4 + i] = uint32_t(key[i * 4]) | (uint32_t(key[i * 4 + 1]) << 8) | (uint32_t(key[i * 4 + 2]) << 16) | (uint32_t(key[i * 4 + 3]) << 24);
+
+    state[12] = 0;
+    state[13] = 0;
+    state[14] = uint32_t(nonce);
+    state[15] = uint32_t(nonce >> 32);
+}
+
+/*
+ * This function is the plain kernel, a block at a time. It's also what the vector
+ * kernels use for whatever is left over at the end.
+ *
+ * @param state                     state from initChaChaState()
+ * @param counter                   block counter of the first block
+ * @param output                    buffer to write
+ * @param blocks                    number of blocks
+ *
+ * @return                          void
+ */
+static void paddingScalar(const uint32_t state[16], uint64_t counter, uint8_t* output, size_t blocks)
+{
+    for (size_t block = 0; block < blocks; block++, counter++)
+    {
+        uint32_t x[16];
+        std::memcpy(x, state, sizeof(x));
+        x[12] = uint32_t(counter);
+        x[13] = uint32_t(counter >> 32);
+
+        uint32_t start[16];
+        std::memcpy(start, x, sizeof(start));
+
+        for (int round = 0; round < 10; round++)
+        {
+            CHACHA_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+            CHACHA_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+            CHACHA_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+            CHACHA_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+            CHACHA_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+            CHACHA_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+            CHACHA_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+            CHACHA_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+        }
+
+        for (int i = 0; i < 16; i++)
+        {
+            uint32_t word = x[i] + start[i];
+            output[i * 4] = uint8_t(word);
+            output[i * 4 + 1] = uint8_t(word >> 8);
+            output[i * 4 + 2] = uint8_t(word >> 16);
+            output[i * 4 + 3] = uint8_t(word >> 24);
+        }
+
+        output += CHACHA_BLOCK_SIZE;
+    }
+}
+
+#if PADDING_X86
+/*
+ * The vector kernels keep word i of every block in vector i, one block per 32 bit lane,
+ * so a quarter round is the same few instructions as the plain one. At the end the
+ * words are transposed back into whole blocks, 4 words (16 bytes) at a time.
+ */
+#define CHACHA_ROTATE_128(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n))
+#define CHACHA_QUARTER_ROUND_128(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTATE_128(d, 16); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTATE_128(b, 12); \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTATE_128(d, 8);  \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTATE_128(b, 7);
+
+PADDING_TARGET("sse2")
+static void paddingSSE2(const uint32_t state[16], uint64_t counter, uint8_t* output, size_t blocks)
+{
+    for (; blocks >= 4; blocks -= 4, counter += 4, output += 4 * CHACHA_BLOCK_SIZE)
+    {
+        __m128i start[16], x[16];
+        for (int i = 0; i < 16; i++)
+            start[i] = _mm_set1_epi32(int(state[i]));
+
+        // the counter is 64 bits across words 12 and 13, so each lane works out its own
+        start[12] = _mm_setr_epi32(int(uint32_t(counter)), int(uint32_t(counter + 1)), int(uint32_t(counter + 2)), int(uint32_t(counter + 3)));
+        start[13] = _mm_setr_epi32(int(uint32_t(counter >> 32)), int(uint32_t((counter + 1) >> 32)), int(uint32_t((counter + 2) >> 32)), int(uint32_t((counter + 3) >> 32)));
+
+        for (int i = 0; i < 16; i++)
+            x[i] = start[i];
+
+        for (int round = 0; round < 10; round++)
+        {
+            CHACHA_QUARTER_ROUND_128(x[0], x[4], x[8], x[12]);
+            CHACHA_QUARTER_ROUND_128(x[1], x[5], x[9], x[13]);
+            CHACHA_QUARTER_ROUND_128(x[2], x[6], x[10], x[14]);
+            CHACHA_QUARTER_ROUND_128(x[3], x[7], x[11], x[15]);
+            CHACHA_QUARTER_ROUND_128(x[0], x[5], x[10], x[15]);
+            CHACHA_QUARTER_ROUND_128(x[1], x[6], x[11], x[12]);
+            CHACHA_QUARTER_ROUND_128(x[2], x[7], x[8], x[13]);
+            CHACHA_QUARTER_ROUND_128(x[3], x[4], x[9], x[14]);
+        }
+
+        for (int group = 0; group < 4; group++)
+        {
+            __m128i a = _mm_add_epi32(x[group * 4], start[group * 4]);
+            __m128i b = _mm_add_epi32(x[group * 4 + 1], start[group * 4 + 1]);
+            __m128i c = _mm_add_epi32(x[group * 4 + 2], start[group * 4 + 2]);
+            __m128i d = _mm_add_epi32(x[group * 4 + 3], start[group * 4 + 3]);
+
+            __m128i ab01 = _mm_unpacklo_epi32(a, b), cd01 = _mm_unpacklo_epi32(c, d);
+            __m128i ab23 = _mm_unpackhi_epi32(a, b), cd23 = _mm_unpackhi_epi32(c, d);
+
+            uint8_t* words = output + group * 16;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(words), _mm_unpacklo_epi64(ab01, cd01));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(words + CHACHA_BLOCK_SIZE), _mm_unpackhi_epi64(ab01, cd01));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(words + 2 * CHACHA_BLOCK_SIZE), _mm_unpacklo_epi64(ab23, cd23));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(words + 3 * CHACHA_BLOCK_SIZE), _mm_unpackhi_epi64(ab23, cd23));
+        }
+    }
+
+    paddingScalar(state, counter, output, blocks);
+}
+
+#define CHACHA_ROTATE_256(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n))
+#define CHACHA_QUARTER_ROUND_256(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = CHACHA_ROTATE_256(d, 16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTATE_256(b, 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = CHACHA_ROTATE_256(d, 8);  \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTATE_256(b, 7);
+
+PADDING_TARGET("avx2")
+static void paddingAVX2(const uint32_t state[16], uint64_t counter, uint8_t* output, size_t blocks)
+{
+    for (; blocks >= 8; blocks -= 8, counter += 8, output += 8 * CHACHA_BLOCK_SIZE)
+    {
+        __m256i start[16], x[16];
+        for (int i = 0; i < 16; i++)
+            start[i] = _mm256_set1_epi32(int(state[i]));
+
+        alignas(32) uint32_t low[8], high[8];
+        for (int lane = 0; lane < 8; lane++)
+        {
+            low[lane] = uint32_t(counter + lane);
+            high[lane] = uint32_t((counter + lane) >> 32);
+        }
+        start[12] = _mm256_load_si256(reinterpret_cast<const __m256i*>(low));
+        start[13] = _mm256_load_si256(reinterpret_cast<const __m256i*>(high));
+
+        for (int i = 0; i < 16; i++)
+            x[i] = start[i];
+
+        for (int round = 0; round < 10; round++)
+        {
+            CHACHA_QUARTER_ROUND_256(x[0], x[4], x[8], x[12]);
+            CHACHA_QUARTER_ROUND_256(x[1], x[5], x[9], x[13]);
+            CHACHA_QUARTER_ROUND_256(x[2], x[6], x[10], x[14]);
+            CHACHA_QUARTER_ROUND_256(x[3], x[7], x[11], x[15]);
+            CHACHA_QUARTER_ROUND_256(x[0], x[5], x[10], x[15]);
+            CHACHA_QUARTER_ROUND_256(x[1], x[6], x[11], x[12]);
+            CHACHA_QUARTER_ROUND_256(x[2], x[7], x[8], x[13]);
+            CHACHA_QUARTER_ROUND_256(x[3], x[4], x[9], x[14]);
+        }
+
+        // the unpacks work within each 128 bit half, so the low half is blocks 0-3, the high half 4-7
+        for (int group = 0; group < 4; group++)
+        {
+            __m256i a = _mm256_add_epi32(x[group * 4], start[group * 4]);
+            __m256i b = _mm256_add_epi32(x[group * 4 + 1], start[group * 4 + 1]);
+            __m256i c = _mm256_add_epi32(x[group * 4 + 2], start[group * 4 + 2]);
+            __m256i d = _mm256_add_epi32(x[group * 4 + 3], start[group * 4 + 3]);
+
+            __m256i ab01 = _mm256_unpacklo_epi32(a, b), cd01 = _mm256_unpacklo_epi32(c, d);
+            __m256i ab23 = _mm256_unpackhi_epi32(a, b), cd23 = _mm256_unpackhi_epi32(c, d);
+            __m256i rows[4] = { _mm256_unpacklo_epi64(ab01, cd01), _mm256_unpackhi_epi64(ab01, cd01),
+                                _mm256_unpacklo_epi64(ab23, cd23), _mm256_unpackhi_epi64(ab23, cd23) };
+
+            uint8_t* words = output + group * 16;
+            for (int block = 0; block < 4; block++)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(words + block * CHACHA_BLOCK_SIZE), _mm256_castsi256_si128(rows[block]));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(words + (block + 4) * CHACHA_BLOCK_SIZE), _mm256_extracti128_si256(rows[block], 1));
+            }
+        }
+    }
+
+    paddingSSE2(state, counter, output, blocks);
+}
+#endif      // PADDING_X86
+
+/*
+ * This function lists every kernel we have, in order of preference, and whether this
+ * machine can run it. The XOR kernels have already asked the CPU what it supports.
+ *
+ * @param   none
+ * @return  std::vector<PaddingKernel>  available kernels, the plain one is always last
+ */
+const std::vector<PaddingKernel>& getPaddingKernels()
+{
+    static const std::vector<PaddingKernel> kernels = []()
+    {
+        std::vector<PaddingKernel> list;
+
+#if PADDING_X86
+        auto supported = [](const char* name)
+        {
+            for (const XorKernel& kernel : getXorKernels())
+                if (std::strcmp(kernel.name, name) == 0)
+                    return kernel.supported;
+
+            return false;
+        };
+
+        list.push_back({ "avx2", paddingAVX2, supported("avx2") });
+        list.push_back({ "sse2", paddingSSE2, supported("sse2") });
+#endif
+        list.push_back({ "scalar", paddingScalar, true });
+
+        return list;
+    }();
+
+    return kernels;
+}
+
+/*
+ * This function keys the generator from a number instead of the OS, so every run
+ * pads the same way. Only for benchmarks and tests, see --deterministic-seed. Has to
+ * be called before the first fillPadding().
+ *
+ * @param seed                      seed
+ *
+ * @return                          void
+ */
+void seedPadding(uint64_t seed)
+{
+    uint8_t key[32] = { 0 };
+    for (int i = 0; i < 8; i++)
+        key[i] = uint8_t(seed >> (i * 8));
+
+    std::call_once(seeded, [&]() { initChaChaState(key, 0, chachaState); });
+}
+
+/*
+ * This function keys the generator from the OS, once, the first time we pad anything,
+ * unless seedPadding() got there first.
+ *
+ * @param   none
+ * @return  void
+ */
+static void seedPaddingFromOS()
+{
+    uint8_t seed[40];
+    size_t filled = 0;
+
+#if defined(__linux__)
+    while (filled < sizeof(seed))
+    {
+        ssize_t result = getrandom(seed + filled, sizeof(seed) - filled, 0);
+        if (result <= 0)
+            break;
+
+        filled += size_t(result);
+    }
+#endif
+
+    // anywhere without getrandom, std::random_device is the OS generator
+    if (filled < sizeof(seed))
+    {
+        std::random_device rd;
+        for (size_t i = 0; i < sizeof(seed); i += sizeof(uint32_t))
+        {
+            uint32_t value = rd();
+            std::memcpy(seed + i, &value, sizeof(value));
+        }
+    }
+
+    uint64_t nonce;
+    std::memcpy(&nonce, seed + 32, sizeof(nonce));
+
+    initChaChaState(seed, nonce, chachaState);
+}
+
+/*
+ * This function hands out key streams, one for every file we're going to encode. They
+ * have to be taken in an order that doesn't depend on the threads, a batch takes one
+ * for each of its files up front.
+ *
+ * @param count                     number of streams wanted
+ *
+ * @return                          the first of them, the rest follow on
+ */
+uint64_t reservePaddingStreams(uint64_t count)
+{
+    return nextStream.fetch_add(count);
+}
+
+/*
+ * This function fills a buffer with random bytes.
+ *
+ * @param data                      buffer to fill
+ * @param length                    number of bytes
+ * @param stream                    key stream of the file, see reservePaddingStreams
+ * @param firstBlock                block of the stream to start at, see PADDING_BLOCKS_PER_CUBE
+ *
+ * @return                          void
+ */
+void fillPadding(uint8_t* data, size_t length, uint64_t stream, uint64_t firstBlock)
+{
+    static const PaddingFunction kernel = []()
+    {
+        for (const PaddingKernel& kernel : getPaddingKernels())
+            if (kernel.supported)
+                return kernel.function;
+
+        return static_cast<PaddingFunction>(paddingScalar);
+    }();
+
+    std::call_once(seeded, seedPaddingFromOS);
+
+    // the file's stream is the process nonce moved on by the stream number
+    uint32_t state[16];
+    std::memcpy(state, chachaState, sizeof(state));
+    uint64_t nonce = ((uint64_t(state[15]) << 32) | state[14]) + stream;
+    state[14] = uint32_t(nonce);
+    state[15] = uint32_t(nonce >> 32);
+
+    size_t blocks = length / CHACHA_BLOCK_SIZE;
+    size_t rest = length - blocks * CHACHA_BLOCK_SIZE;
+
+    kernel(state, firstBlock, data, blocks);
+
+    // the last part block comes from a block of its own
+    if (rest > 0)
+    {
+        uint8_t last[CHACHA_BLOCK_SIZE];
+        paddingScalar(state, firstBlock + blocks, last, 1);
+        std::memcpy(data + blocks * CHACHA_BLOCK_SIZE, last, rest);
+    }
+}
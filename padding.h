@@ -0,0 +1,36 @@
+/*
+ * padding.h
+ * This file contains the random padding that fills the cube past the Huffman bits.
+ * It's ChaCha20 run in counter mode, keyed once per process from the OS (getrandom on
+ * Linux), or from a fixed seed with --deterministic-seed for repeatable runs. There's a
+ * plain version plus SSE2 and AVX2 versions that work 4 and 8 blocks side by side.
+ *
+*/
+#pragma once
+#include "file_encryptor.h"
+
+// ChaCha20 makes 64 bytes a block
+constexpr uint32_t CHACHA_BLOCK_SIZE = 64;
+
+/*
+ * every file gets a key stream of its own (a nonce, see reservePaddingStreams) and every
+ * cube of it this many blocks of that stream, so the padding only depends on where it
+ * goes and not on which thread gets there first
+ */
+constexpr uint64_t PADDING_BLOCKS_PER_CUBE = SIXTEEN_MEGABYTES / CHACHA_BLOCK_SIZE;
+
+// writes blocks * CHACHA_BLOCK_SIZE bytes of key stream, starting at block counter
+using PaddingFunction = void (*)(const uint32_t state[16], uint64_t counter, uint8_t* output, size_t blocks);
+
+struct PaddingKernel
+{
+    const char* name;
+    PaddingFunction function;
+    bool supported;
+};
+
+void	fillPadding(uint8_t* data, size_t length, uint64_t stream, uint64_t firstBlock);
+const std::vector<PaddingKernel>& getPaddingKernels();
+void	initChaChaState(const uint8_t key[32], uint64_t nonce, uint32_t state[16]);
+uint64_t	reservePaddingStreams(uint64_t count);
+void	seedPadding(uint64_t seed);
@@ -0,0 +1,453 @@
+/*
+ * rubix.cpp
+ *
+ * The 'Rubix' shift used to tag every element of the cube with where it was going and
+ * then sort the whole cube to get it there. Following the tags through, every byte
+ * ends up at
+ *
+ *		out[z + key[X]][y + key[X]][X]		where X = x + key[y]
+ *
+ * so it's really three rotations. First each row is rotated along X by key[row], then
+ * within each column X everything moves key[X] along Y and key[X] along Z. Done as
+ * three passes over the cube, each pass only needs a small part of the cube at a time:
+ *
+ *		X pass		one row at a time, two memcpy's per row
+ *		Y pass		one z slice at a time
+ *		Z pass		one y slab at a time
+ *
+ * This produces exactly the same cube the sort did, without sorting.
+ *
+ * The final shuffle was the same idea, a counter written into the upper bytes of
+ * slot size - (i * prime) % size, then another sort. That works out to
+ *
+ *		out[i] = in[-(i * prime) mod size]
+ *
+ * and since prime is odd it has an inverse mod size, so decoding is the same gather
+ * with the inverse.
+ *
+ * Putting the two together, byte p = (z, y, x) of the cube before the shift ends up in
+ * the file at -(rubix(p) * prime^-1) mod size, where rubix(p) is where the shift put
+ * it. So decoding doesn't need either pass over the whole cube, it can gather just the
+ * bytes it wants straight from the file, see gatherDecode.
+ *
+ * The cube doesn't have to be 256 on a side, small files get small cubes (see
+ * CUBE_SIDES). Every pass is a template on the side, so each size gets its own copy
+ * with the masks and strides as constants, and withCubeSide picks the copy from the
+ * size of the cube we're handed, or says no if it isn't one of them, so every entry
+ * point returns false rather than touch a cube it can't walk. The key still gives a byte per row and drawer, a
+ * smaller cube uses the first SIDE of them and takes them mod SIDE.
+ */
+#include "rubix.h"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+static_assert((RUBIX_SIDE_SIZE & (RUBIX_SIDE_SIZE - 1)) == 0, "RUBIX_SIDE_SIZE has to be a power of 2");
+static_assert((std::size(CUBE_SIDES) == 5) && (CUBE_SIDES[0] == 16) && (CUBE_SIDES[4] == RUBIX_SIDE_SIZE), "withCubeSide needs a case for every cube side");
+
+// everything about a cube that follows from its side
+template <uint32_t SIDE>
+struct CubeGeometry
+{
+    static_assert((SIDE & (SIDE - 1)) == 0, "cube side has to be a power of 2");
+    static_assert(SIDE <= RUBIX_SIDE_SIZE, "the key only has RUBIX_SIDE_SIZE shifts");
+
+    static constexpr uint32_t MASK			= SIDE - 1;
+    static constexpr uint32_t ROW_SIZE		= SIDE;
+    static constexpr uint32_t SLICE_SIZE	= SIDE * SIDE;
+    static constexpr uint32_t SIZE			= SIDE * SIDE * SIDE;
+};
+
+/*
+ * This function calls fn with the side of a cube of the given size as a compile time
+ * constant, so fn can hand it on to the templated passes. The cube size has to be one
+ * of CUBE_SIDES cubed, anything else is left to the caller to report.
+ *
+ * @param cubeSize                  number of bytes in the cube
+ * @param fn                        called as fn(std::integral_constant<uint32_t, SIDE>())
+ *
+ * @return                          false if the size isn't one of CUBE_SIDES cubed, fn isn't called
+ */
+template <typename F>
+static bool withCubeSide(size_t cubeSize, F&& fn)
+{
+    switch (cubeSize)
+    {
+    case CubeGeometry<16>::SIZE:	fn(std::integral_constant<uint32_t, 16>());		return true;
+    case CubeGeometry<32>::SIZE:	fn(std::integral_constant<uint32_t, 32>());		return true;
+    case CubeGeometry<64>::SIZE:	fn(std::integral_constant<uint32_t, 64>());		return true;
+    case CubeGeometry<128>::SIZE:	fn(std::integral_constant<uint32_t, 128>());	return true;
+    case CubeGeometry<256>::SIZE:	fn(std::integral_constant<uint32_t, 256>());	return true;
+    default:						return false;
+    }
+}
+
+/*
+ * This function finds a prime number for the final shuffle. In the event the prime
+ * number is a factor of the maximum file size, we'll keep increasing until we find a 
+ * suitable value.
+ * 
+ *
+ * @param index                     start at the specified value from the key
+ *
+ * @return                          prime number not a factor of maximum file size
+ */
+uint32_t getPrime(uint8_t index)
+{
+    while (SIXTEEN_MEGABYTES % primes[index] == 0)
+        index++;
+
+    return primes[index];
+}
+
+/*
+ * This function pulls the shift amounts out of the key. Rows are shifted by the key
+ * byte of their y coordinate, drawers by the key byte of their x coordinate.
+ *
+ * @param key                       prepared key
+ * @param shifts                    shift tables to fill in
+ *
+ * @return                          void
+ */
+void getRubixShifts(const std::vector<uint8_t>& key, RubixShifts& shifts)
+{
+    for (uint32_t i = 0; i < RUBIX_SIDE_SIZE; i++)
+    {
+        shifts.row[i] = uint8_t(key[i] & (RUBIX_SIDE_SIZE - 1));
+        shifts.drawer[i] = uint8_t(key[i] & (RUBIX_SIDE_SIZE - 1));
+    }
+}
+
+/*
+ * This function rotates every row of the cube along the X axis, in place. Row y moves
+ * right by shift[y] when encoding and back left when decoding. Rows are contiguous, so
+ * it's a copy of the row out and two memcpy's back in, which the library does with
+ * vector moves.
+ *
+ * @param cube                      cube to rotate
+ * @param shifts                    shift for each row
+ * @param encoding                  rotate right if true, left otherwise
+ * @param firstSlice                first z slice to do
+ * @param lastSlice                 one past the last z slice to do
+ *
+ * @return                          void
+ */
+template <uint32_t SIDE>
+static void rotateRows(std::vector<FILE_BUFFER_TYPE>& cube, const RubixShifts& shifts, bool encoding, size_t firstSlice, size_t lastSlice)
+{
+    using G = CubeGeometry<SIDE>;
+    std::array<FILE_BUFFER_TYPE, G::ROW_SIZE> row;
+
+    for (size_t z = firstSlice; z < lastSlice; z++)
+        for (uint32_t y = 0; y < SIDE; y++)
+        {
+            FILE_BUFFER_TYPE* start = cube.data() + (z * G::SLICE_SIZE) + (y * G::ROW_SIZE);
+            uint32_t shift = encoding ? shifts.row[y] & G::MASK : (SIDE - shifts.row[y]) & G::MASK;
+
+            if (shift == 0)
+                continue;
+
+            std::memcpy(row.data(), start, sizeof(row));
+            std::memcpy(start + shift, row.data(), (G::ROW_SIZE - shift) * sizeof(FILE_BUFFER_TYPE));
+            std::memcpy(start, row.data() + (G::ROW_SIZE - shift), shift * sizeof(FILE_BUFFER_TYPE));
+        }
+}
+
+/*
+ * This function moves every column of each z slice along the Y axis, element x of
+ * row y goes to row y + shift[x] (or comes back from it when decoding).
+ *
+ * @param source                    cube to read
+ * @param destination               cube to write
+ * @param shifts                    shift for each column
+ * @param encoding                  move down if true, up otherwise
+ * @param firstSlice                first z slice to do
+ * @param lastSlice                 one past the last z slice to do
+ *
+ * @return                          void
+ */
+template <uint32_t SIDE>
+static void shiftColumns(const std::vector<FILE_BUFFER_TYPE>& source, std::vector<FILE_BUFFER_TYPE>& destination, const RubixShifts& shifts, bool encoding, size_t firstSlice, size_t lastSlice)
+{
+    using G = CubeGeometry<SIDE>;
+
+    for (size_t z = firstSlice; z < lastSlice; z++)
+    {
+        const FILE_BUFFER_TYPE* in = source.data() + (z * G::SLICE_SIZE);
+        FILE_BUFFER_TYPE* out = destination.data() + (z * G::SLICE_SIZE);
+
+        for (uint32_t y = 0; y < SIDE; y++)
+            for (uint32_t x = 0; x < SIDE; x++)
+            {
+                uint32_t from = encoding ? (y - shifts.drawer[x]) & G::MASK : (y + shifts.drawer[x]) & G::MASK;
+                out[(y * G::ROW_SIZE) + x] = in[(from * G::ROW_SIZE) + x];
+            }
+    }
+}
+
+/*
+ * This function moves every drawer along the Z axis, element x of slice z goes to
+ * slice z + shift[x] (or comes back from it when decoding). We go a y slab at a time
+ * so we only touch one row of each slice per slab.
+ *
+ * @param source                    cube to read
+ * @param destination               cube to write
+ * @param shifts                    shift for each drawer
+ * @param encoding                  move back if true, forward otherwise
+ * @param firstSlab                 first y slab to do
+ * @param lastSlab                  one past the last y slab to do
+ *
+ * @return                          void
+ */
+template <uint32_t SIDE>
+static void shiftDrawers(const std::vector<FILE_BUFFER_TYPE>& source, std::vector<FILE_BUFFER_TYPE>& destination, const RubixShifts& shifts, bool encoding, size_t firstSlab, size_t lastSlab)
+{
+    using G = CubeGeometry<SIDE>;
+
+    for (size_t y = firstSlab; y < lastSlab; y++)
+    {
+        const FILE_BUFFER_TYPE* in = source.data() + (y * G::ROW_SIZE);
+        FILE_BUFFER_TYPE* out = destination.data() + (y * G::ROW_SIZE);
+
+        for (uint32_t z = 0; z < SIDE; z++)
+            for (uint32_t x = 0; x < SIDE; x++)
+            {
+                uint32_t from = encoding ? (z - shifts.drawer[x]) & G::MASK : (z + shifts.drawer[x]) & G::MASK;
+                out[(z * G::SLICE_SIZE) + x] = in[(from * G::SLICE_SIZE) + x];
+            }
+    }
+}
+
+/*
+ * This function does the 'Rubix' shift when encoding. The cube is shifted in place,
+ * scratch has to be the same size as the cube. The X and Y passes only ever look at
+ * one z slice, so each thread takes a run of slices and does both passes on them, the
+ * Z pass is split up by y slab.
+ *
+ * @param cube                      cube to shift, any of the CUBE_SIDES
+ * @param scratch                   working space, same size as the cube
+ * @param shifts                    shift tables from the key
+ * @param pool                      threads to split the work across
+ *
+ * @return                          false if the cube isn't one of the CUBE_SIDES
+ */
+bool rubixEncode(std::vector<FILE_BUFFER_TYPE>& cube, std::vector<FILE_BUFFER_TYPE>& scratch, const RubixShifts& shifts, ThreadPool& pool)
+{
+    if (scratch.size() != cube.size())
+        return false;
+
+    return withCubeSide(cube.size(), [&](auto side)
+    {
+        constexpr uint32_t SIDE = decltype(side)::value;
+
+        pool.parallelFor(SIDE, [&](size_t first, size_t last)
+        {
+            rotateRows<SIDE>(cube, shifts, true, first, last);
+            shiftColumns<SIDE>(cube, scratch, shifts, true, first, last);
+        });
+
+        pool.parallelFor(SIDE, [&](size_t first, size_t last)
+        {
+            shiftDrawers<SIDE>(scratch, cube, shifts, true, first, last);
+        });
+    });
+}
+
+/*
+ * This function undoes the 'Rubix' shift when decoding, same passes as encoding in
+ * the opposite order.
+ *
+ * @param cube                      cube to shift
+ * @param scratch                   working space, same size as the cube
+ * @param shifts                    shift tables from the key
+ * @param pool                      threads to split the work across
+ *
+ * @return                          false if the cube isn't one of the CUBE_SIDES
+ */
+bool rubixDecode(std::vector<FILE_BUFFER_TYPE>& cube, std::vector<FILE_BUFFER_TYPE>& scratch, const RubixShifts& shifts, ThreadPool& pool)
+{
+    if (scratch.size() != cube.size())
+        return false;
+
+    return withCubeSide(cube.size(), [&](auto side)
+    {
+        constexpr uint32_t SIDE = decltype(side)::value;
+
+        pool.parallelFor(SIDE, [&](size_t first, size_t last)
+        {
+            shiftDrawers<SIDE>(cube, scratch, shifts, false, first, last);
+        });
+
+        pool.parallelFor(SIDE, [&](size_t first, size_t last)
+        {
+            shiftColumns<SIDE>(scratch, cube, shifts, false, first, last);
+            rotateRows<SIDE>(cube, shifts, false, first, last);
+        });
+    });
+}
+
+/*
+ * This function gathers out[i] = in[-(i * multiplier) mod size] for a run of chunks. The
+ * writes go straight down the output, but the reads aren't blocked: each read is the
+ * prime away from the last, so each lands on a new cache line and a chunk reads from
+ * all over the cube. Blocking would need a run of outputs whose reads sit close
+ * together, and multiplying by the prime spreads any run of slots across the whole
+ * cube, so there isn't one short of splitting the shuffle into more passes. A chunk is
+ * only a unit of work, each works out its own starting index, so chunks don't depend on
+ * each other and can go to any thread. The smallest cubes are less than a chunk,
+ * they're one chunk the size of the cube.
+ *
+ * @param source                    cube to read
+ * @param destination               cube to write
+ * @param multiplier                prime for encoding, its inverse for decoding
+ * @param firstChunk                first chunk to do
+ * @param lastChunk                 one past the last chunk to do
+ *
+ * @return                          void
+ */
+template <uint32_t SIDE>
+static void gatherShuffle(const FILE_BUFFER_TYPE* source, FILE_BUFFER_TYPE* destination, uint32_t multiplier, size_t firstChunk, size_t lastChunk)
+{
+    constexpr uint32_t mask = CubeGeometry<SIDE>::SIZE - 1;
+    constexpr uint32_t chunkSize = std::min(SHUFFLE_CHUNK_SIZE, CubeGeometry<SIDE>::SIZE);
+    const uint32_t step = 0u - multiplier;
+
+    for (uint32_t chunk = uint32_t(firstChunk * chunkSize); chunk < lastChunk * chunkSize; chunk += chunkSize)
+    {
+        // unsigned overflow is fine here, the cube size divides 2^32
+        uint32_t from = chunk * step;
+
+        for (uint32_t i = chunk; i < chunk + chunkSize; i++)
+        {
+            destination[i] = source[from & mask];
+            from += step;
+        }
+    }
+}
+
+/*
+ * This function runs gatherShuffle over the whole of a cube.
+ *
+ * @param source                    cube to read, destination.size() long
+ * @param destination               cube to write, any of the CUBE_SIDES
+ * @param multiplier                prime for encoding, its inverse for decoding
+ * @param pool                      threads to split the chunks across
+ *
+ * @return                          false if the cube isn't one of the CUBE_SIDES
+ */
+static bool shuffleCube(const FILE_BUFFER_TYPE* source, std::vector<FILE_BUFFER_TYPE>& destination, uint32_t multiplier, ThreadPool& pool)
+{
+    return withCubeSide(destination.size(), [&](auto side)
+    {
+        constexpr uint32_t SIDE = decltype(side)::value;
+        constexpr uint32_t chunks = CubeGeometry<SIDE>::SIZE / std::min(SHUFFLE_CHUNK_SIZE, CubeGeometry<SIDE>::SIZE);
+
+        pool.parallelFor(chunks, [&](size_t first, size_t last)
+        {
+            gatherShuffle<SIDE>(source, destination.data(), multiplier, first, last);
+        });
+    });
+}
+
+/*
+ * This function finds the inverse of an odd number mod 2^32 by Newton's iteration,
+ * every step doubles the number of correct low bits (3, 6, 12, 24, 48).
+ *
+ * @param value                     odd number to invert
+ *
+ * @return                          inverse, value * inverse == 1 mod 2^32
+ */
+static uint32_t inverseOf(uint32_t value)
+{
+    uint32_t inverse = value;
+    for (int i = 0; i < 4; i++)
+        inverse *= 2 - (value * inverse);
+
+    return inverse;
+}
+
+/*
+ * This function undoes the final shuffle and the 'Rubix' shift in one go for a run of
+ * the cube, destination[p] for first <= p < last, everything else is left alone. Each
+ * byte comes straight from the file, following it through the shift and then the
+ * shuffle: column X = x + row[y], moved drawer[X] along Y and Z, then slot -(that *
+ * prime^-1). Same bytes as shuffleDecode followed by rubixDecode.
+ *
+ * @param source                    encoded cube, destination.size() long, can be
+ *                                  straight out of a mapped file
+ * @param destination               cube to write, any of the CUBE_SIDES
+ * @param first                     first byte of the cube to gather
+ * @param last                      one past the last byte to gather
+ * @param shifts                    shift tables from the key
+ * @param prime                     prime from getPrime()
+ * @param pool                      threads to split the run across
+ *
+ * @return                          false if the cube isn't one of the CUBE_SIDES or the run is past its end
+ */
+bool gatherDecode(const FILE_BUFFER_TYPE* source, std::vector<FILE_BUFFER_TYPE>& destination, uint32_t first, uint32_t last,
+    const RubixShifts& shifts, uint32_t prime, ThreadPool& pool)
+{
+    const uint32_t step = 0u - inverseOf(prime);
+
+    if (last > destination.size())
+        return false;
+
+    return withCubeSide(destination.size(), [&](auto side)
+    {
+        using G = CubeGeometry<decltype(side)::value>;
+
+        if (last <= first)
+            return;
+
+        pool.parallelFor((last - first + SHUFFLE_CHUNK_SIZE - 1) / SHUFFLE_CHUNK_SIZE, [&](size_t firstChunk, size_t lastChunk)
+        {
+            uint32_t end = uint32_t(std::min<size_t>(last, first + (lastChunk * SHUFFLE_CHUNK_SIZE)));
+
+            for (uint32_t p = uint32_t(first + (firstChunk * SHUFFLE_CHUNK_SIZE)); p < end; p++)
+            {
+                uint32_t x = p & G::MASK;
+                uint32_t y = (p / G::ROW_SIZE) & G::MASK;
+                uint32_t z = p / G::SLICE_SIZE;
+
+                uint32_t column = (x + shifts.row[y]) & G::MASK;
+                uint32_t drawer = shifts.drawer[column] & G::MASK;
+                uint32_t shifted = (((z + drawer) & G::MASK) * G::SLICE_SIZE) + (((y + drawer) & G::MASK) * G::ROW_SIZE) + column;
+
+                // unsigned overflow is fine here, the cube size divides 2^32
+                destination[p] = source[(shifted * step) & (G::SIZE - 1)];
+            }
+        });
+    });
+}
+
+/*
+ * This function does the final shuffle when encoding.
+ *
+ * @param source                    cube to shuffle, destination.size() long
+ * @param destination               shuffled cube, any of the CUBE_SIDES
+ * @param prime                     prime from getPrime()
+ * @param pool                      threads to split the chunks across
+ *
+ * @return                          false if the cube isn't one of the CUBE_SIDES
+ */
+bool shuffleEncode(const FILE_BUFFER_TYPE* source, std::vector<FILE_BUFFER_TYPE>& destination, uint32_t prime, ThreadPool& pool)
+{
+    return shuffleCube(source, destination, prime, pool);
+}
+
+/*
+ * This function undoes the final shuffle when decoding. Slot -(i * prime) came from
+ * slot i, so slot j came from -(j * prime^-1).
+ *
+ * @param source                    cube to unshuffle, destination.size() long, can be
+ *                                  straight out of a mapped file
+ * @param destination               unshuffled cube, any of the CUBE_SIDES
+ * @param prime                     prime from getPrime()
+ * @param pool                      threads to split the chunks across
+ *
+ * @return                          false if the cube isn't one of the CUBE_SIDES
+ */
+bool shuffleDecode(const FILE_BUFFER_TYPE* source, std::vector<FILE_BUFFER_TYPE>& destination, uint32_t prime, ThreadPool& pool)
+{
+    return shuffleCube(source, destination, inverseOf(prime), pool);
+}
@@ -0,0 +1,29 @@
+/*
+ * rubix.h
+ * This file contains the two stages that move bytes around the cube, the 'Rubix' shift
+ * along each axis by amounts taken from the key, and the final prime shuffle.
+ *
+*/
+#pragma once
+#include "file_encryptor.h"
+#include "thread_pool.h"
+#include <array>
+
+// The shift amounts only depend on the key, so we work them out once up front
+struct RubixShifts
+{
+    std::array<uint8_t, RUBIX_SIDE_SIZE> row;		// X axis, row y rotates by row[y]
+    std::array<uint8_t, RUBIX_SIDE_SIZE> drawer;	// Y and Z axis, column x moves by drawer[x]
+};
+
+// the shuffle is shared out across the threads in chunks of this many output elements, each
+// chunk stands on its own. Only a unit of work, the reads aren't blocked, see gatherShuffle
+constexpr uint32_t SHUFFLE_CHUNK_SIZE = 65'536;
+
+bool	gatherDecode(const FILE_BUFFER_TYPE* source, std::vector<FILE_BUFFER_TYPE>& destination, uint32_t first, uint32_t last, const RubixShifts& shifts, uint32_t prime, ThreadPool& pool);
+uint32_t	getPrime(uint8_t index);
+void	getRubixShifts(const std::vector<uint8_t>& key, RubixShifts& shifts);
+bool	rubixEncode(std::vector<FILE_BUFFER_TYPE>& cube, std::vector<FILE_BUFFER_TYPE>& scratch, const RubixShifts& shifts, ThreadPool& pool);
+bool	rubixDecode(std::vector<FILE_BUFFER_TYPE>& cube, std::vector<FILE_BUFFER_TYPE>& scratch, const RubixShifts& shifts, ThreadPool& pool);
+bool	shuffleEncode(const FILE_BUFFER_TYPE* source, std::vector<FILE_BUFFER_TYPE>& destination, uint32_t prime, ThreadPool& pool);
+bool	shuffleDecode(const FILE_BUFFER_TYPE* source, std::vector<FILE_BUFFER_TYPE>& destination, uint32_t prime, ThreadPool& pool);
@@ -0,0 +1,133 @@
+/*
+ * thread_pool.cpp
+ *
+ * The workers are started once and sleep between jobs. A job is split into one range
+ * per thread, the calling thread takes the first range itself and waits for the rest.
+ * Ranges are fixed by the thread count, so which thread does what never changes the
+ * result as long as the ranges don't write to the same place.
+ */
+#include "thread_pool.h"
+#include <algorithm>
+
+/*
+ * This function starts the workers, one less than the thread count since the caller
+ * does its share of every job.
+ *
+ * @param threadCount               number of threads to split jobs across, at least 1
+ */
+ThreadPool::ThreadPool(unsigned threadCount)
+    : threadCount(std::clamp(threadCount, 1u, MAX_THREADS))
+{
+    for (unsigned i = 1; i < this->threadCount; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+/*
+ * This function wakes the workers up to tell them to stop, then waits for them.
+ */
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+/*
+ * This function works out the range for one thread. The ranges cover [0, count) with
+ * no gaps and differ in size by at most one.
+ *
+ * @param count                     total number of items
+ * @param parts                     number of ranges
+ * @param index                     which range
+ * @param first                     start of the range
+ * @param last                      one past the end of the range
+ *
+ * @return                          void
+ */
+static void splitRange(size_t count, unsigned parts, unsigned index, size_t& first, size_t& last)
+{
+    first = (count * index) / parts;
+    last = (count * (index + 1)) / parts;
+}
+
+/*
+ * This function runs a job across the pool and returns once every range is done.
+ * Only one thread should be handing out jobs at a time.
+ *
+ * @param count                     number of items to split up
+ * @param work                      called once per non empty range
+ *
+ * @return                          void
+ */
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t first, size_t last)>& work)
+{
+    if ((threadCount == 1) || (count <= 1))
+    {
+        if (count > 0)
+            work(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &work;
+        jobCount = count;
+        pending = threadCount - 1;
+        generation++;
+    }
+    wake.notify_all();
+
+    size_t first, last;
+    splitRange(count, threadCount, 0, first, last);
+    if (first < last)
+        work(first, last);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this]() { return pending == 0; });
+    job = nullptr;
+}
+
+/*
+ * This function is what each worker runs, wait for a job, do our range, repeat.
+ *
+ * @param index                     which range this worker takes, 1 and up
+ *
+ * @return                          void
+ */
+void ThreadPool::workerLoop(unsigned index)
+{
+    uint64_t seen = 0;
+
+    for (;;)
+    {
+        const std::function<void(size_t, size_t)>* current;
+        size_t count;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this, seen]() { return stopping || (generation != seen); });
+
+            if (stopping)
+                return;
+
+            seen = generation;
+            current = job;
+            count = jobCount;
+        }
+
+        size_t first, last;
+        splitRange(count, threadCount, index, first, last);
+        if (first < last)
+            (*current)(first, last);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending--;
+        }
+        finished.notify_one();
+    }
+}
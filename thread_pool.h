@@ -0,0 +1,46 @@
+/*
+ * thread_pool.h
+ * This file contains a small pool of worker threads for splitting a stage up into
+ * independent pieces, like slices of the cube.
+ *
+*/
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+constexpr unsigned MAX_THREADS = 256;
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threadCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return threadCount; }
+
+    // runs work(first, last) over [0, count) split into one contiguous range per thread
+    void parallelFor(size_t count, const std::function<void(size_t first, size_t last)>& work);
+
+private:
+    void workerLoop(unsigned index);
+
+    unsigned threadCount;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    const std::function<void(size_t, size_t)>* job = nullptr;
+    size_t jobCount = 0;
+    uint64_t generation = 0;
+    unsigned pending = 0;
+    bool stopping = false;
+};
@@ -0,0 +1,269 @@
+/*
+ * xor_kernel.cpp
+ *
+ * The XOR stage used to go a byte at a time, working out (i + 1) % MAX_KEY_SIZE for
+ * every byte. Since the key is 1000 bytes, vectors don't line up with the key, so we
+ * XOR against a pad of the key repeated 8 times instead (see KEY_PAD_SIZE), which
+ * lines up with every vector width. Every kernel just XORs two buffers together, into
+ * the first one or into a third, so the file can be XORed on its way into our buffer.
+ *
+ * The vector kernels are compiled for their instruction set whatever the compiler is
+ * targeting, and only called if cpuid says the CPU (and OS) supports them.
+ */
+#include "xor_kernel.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define XOR_KERNEL_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define XOR_TARGET(isa)
+#else
+#include <cpuid.h>
+#define XOR_TARGET(isa) __attribute__((target(isa)))
+#endif
+#else
+#define XOR_KERNEL_X86 0
+#endif
+
+/*
+ * This function lays the key end to end KEY_PAD_SIZE / MAX_KEY_SIZE times.
+ *
+ * @param key                       prepared key, MAX_KEY_SIZE bytes
+ * @param pad                       repeated key
+ *
+ * @return                          void
+ */
+void buildKeyPad(const std::vector<uint8_t>& key, std::vector<uint8_t>& pad)
+{
+    pad.resize(KEY_PAD_SIZE);
+    for (uint32_t i = 0; i < KEY_PAD_SIZE; i += MAX_KEY_SIZE)
+        std::copy(key.begin(), key.begin() + MAX_KEY_SIZE, pad.begin() + i);
+}
+
+/*
+ * This function is the plain kernel, 8 bytes at a time. It's also what every other
+ * kernel uses for whatever is left over at the end.
+ *
+ * @param destination               buffer to write
+ * @param source                    buffer to XOR, can be the same as destination
+ * @param pad                       bytes to XOR with
+ * @param length                    number of bytes
+ *
+ * @return                          void
+ */
+static void xorScalar(uint8_t* destination, const uint8_t* source, const uint8_t* pad, size_t length)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t d, p;
+        std::memcpy(&d, source + i, sizeof(d));
+        std::memcpy(&p, pad + i, sizeof(p));
+        d ^= p;
+        std::memcpy(destination + i, &d, sizeof(d));
+    }
+
+    for (; i < length; i++)
+        destination[i] = source[i] ^ pad[i];
+}
+
+#if XOR_KERNEL_X86
+XOR_TARGET("sse2")
+static void xorSSE2(uint8_t* destination, const uint8_t* source, const uint8_t* pad, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m128i d0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+        __m128i d1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 16));
+        __m128i d2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 32));
+        __m128i d3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 48));
+        d0 = _mm_xor_si128(d0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pad + i)));
+        d1 = _mm_xor_si128(d1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pad + i + 16)));
+        d2 = _mm_xor_si128(d2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pad + i + 32)));
+        d3 = _mm_xor_si128(d3, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pad + i + 48)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), d0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 16), d1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 32), d2);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 48), d3);
+    }
+
+    xorScalar(destination + i, source + i, pad + i, length - i);
+}
+
+XOR_TARGET("avx2")
+static void xorAVX2(uint8_t* destination, const uint8_t* source, const uint8_t* pad, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m256i d0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+        __m256i d1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i + 32));
+        d0 = _mm256_xor_si256(d0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pad + i)));
+        d1 = _mm256_xor_si256(d1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pad + i + 32)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), d0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i + 32), d1);
+    }
+
+    xorScalar(destination + i, source + i, pad + i, length - i);
+}
+
+XOR_TARGET("avx512f")
+static void xorAVX512(uint8_t* destination, const uint8_t* source, const uint8_t* pad, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m512i d = _mm512_loadu_si512(source + i);
+        d = _mm512_xor_si512(d, _mm512_loadu_si512(pad + i));
+        _mm512_storeu_si512(destination + i, d);
+    }
+
+    xorScalar(destination + i, source + i, pad + i, length - i);
+}
+
+/*
+ * This function runs cpuid for the given leaf and sub leaf.
+ *
+ * @param leaf                      cpuid leaf
+ * @param subLeaf                   cpuid sub leaf
+ * @param registers                 eax, ebx, ecx, edx
+ *
+ * @return                          void
+ */
+static void cpuid(uint32_t leaf, uint32_t subLeaf, uint32_t registers[4])
+{
+#ifdef _MSC_VER
+    int values[4];
+    __cpuidex(values, int(leaf), int(subLeaf));
+    for (int i = 0; i < 4; i++)
+        registers[i] = uint32_t(values[i]);
+#else
+    __cpuid_count(leaf, subLeaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+/*
+ * This function reads XCR0, which tells us which vector registers the OS saves on a
+ * context switch. A CPU feature is no use to us unless the OS saves its registers.
+ *
+ * @param   none
+ * @return  uint64_t                XCR0
+ */
+static uint64_t readXCR0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64_t(edx) << 32) | eax;
+#endif
+}
+#endif      // XOR_KERNEL_X86
+
+/*
+ * This function lists every kernel we have, in order of preference, and whether this
+ * machine can run it. Worked out once, the first time anyone asks.
+ *
+ * @param   none
+ * @return  std::vector<XorKernel>  available kernels, the plain one is always last
+ */
+const std::vector<XorKernel>& getXorKernels()
+{
+    static const std::vector<XorKernel> kernels = []()
+    {
+        std::vector<XorKernel> list;
+
+#if XOR_KERNEL_X86
+        uint32_t leaf0[4], leaf1[4], leaf7[4] = { 0, 0, 0, 0 };
+        cpuid(0, 0, leaf0);
+        cpuid(1, 0, leaf1);
+        if (leaf0[0] >= 7)
+            cpuid(7, 0, leaf7);
+
+        bool sse2 = (leaf1[3] >> 26) & 1;
+        bool osxsave = (leaf1[2] >> 27) & 1;
+        uint64_t xcr0 = osxsave ? readXCR0() : 0;
+
+        // XMM and YMM state for AVX2, plus opmask and upper ZMM state for AVX-512
+        bool avx2 = osxsave && ((xcr0 & 0x06) == 0x06) && ((leaf7[1] >> 5) & 1);
+        bool avx512 = osxsave && ((xcr0 & 0xE6) == 0xE6) && ((leaf7[1] >> 16) & 1);
+
+        list.push_back({ "avx512", xorAVX512, avx512 });
+        list.push_back({ "avx2", xorAVX2, avx2 });
+        list.push_back({ "sse2", xorSSE2, sse2 });
+#endif
+        list.push_back({ "scalar", xorScalar, true });
+
+        return list;
+    }();
+
+    return kernels;
+}
+
+/*
+ * This function picks the best kernel this machine supports.
+ *
+ * @param   none
+ * @return  XorFunction             kernel to use
+ */
+XorFunction selectXorKernel()
+{
+    static const XorFunction best = []()
+    {
+        for (const XorKernel& kernel : getXorKernels())
+            if (kernel.supported)
+                return kernel.function;
+
+        return static_cast<XorFunction>(xorScalar);
+    }();
+
+    return best;
+}
+
+/*
+ * This function XORs a buffer against the key pad into another buffer, a pad at a time.
+ * keyOffset is how far into the key the source starts, for when something else has
+ * already used up the start of the key.
+ *
+ * @param destination               buffer to write
+ * @param source                    buffer to XOR, can be the same as destination
+ * @param length                    number of bytes
+ * @param keyOffset                 position in the key of the first byte
+ * @param pad                       key pad from buildKeyPad()
+ * @param kernel                    kernel to use
+ *
+ * @return                          void
+ */
+void xorCopyWithPad(uint8_t* destination, const uint8_t* source, size_t length, size_t keyOffset, const std::vector<uint8_t>& pad, XorFunction kernel)
+{
+    size_t padOffset = keyOffset % KEY_PAD_SIZE;
+
+    for (size_t i = 0; i < length; )
+    {
+        size_t count = std::min<size_t>(KEY_PAD_SIZE - padOffset, length - i);
+        kernel(destination + i, source + i, pad.data() + padOffset, count);
+
+        i += count;
+        padOffset = 0;
+    }
+}
+
+/*
+ * This function XORs a buffer against the key pad in place. The buffer has to start at
+ * the start of the key.
+ *
+ * @param data                      buffer to XOR
+ * @param length                    number of bytes
+ * @param pad                       key pad from buildKeyPad()
+ * @param kernel                    kernel to use
+ *
+ * @return                          void
+ */
+void xorWithPad(uint8_t* data, size_t length, const std::vector<uint8_t>& pad, XorFunction kernel)
+{
+    xorCopyWithPad(data, data, length, 0, pad, kernel);
+}
@@ -0,0 +1,34 @@
+/*
+ * xor_kernel.h
+ * This file contains the XOR stage, XORing a buffer against the prepared key. There's a
+ * plain version plus SSE2, AVX2 and AVX-512 versions, the best one the CPU supports is
+ * picked the first time we need it.
+ *
+*/
+#pragma once
+#include "file_encryptor.h"
+
+/*
+ * the key repeats every MAX_KEY_SIZE bytes, and 8000 is the first multiple of that which
+ * is also a multiple of 64 bytes (the widest vector). With the key laid end to end 8
+ * times we can XOR 8000 bytes at a time with straight vector loads from both buffers.
+ */
+constexpr uint32_t KEY_PAD_SIZE = 8 * MAX_KEY_SIZE;
+
+static_assert(KEY_PAD_SIZE % 64 == 0, "key pad has to be a whole number of vectors");
+
+// destination = source XOR pad for length bytes, source and destination can be the same
+using XorFunction = void (*)(uint8_t* destination, const uint8_t* source, const uint8_t* pad, size_t length);
+
+struct XorKernel
+{
+    const char* name;
+    XorFunction function;
+    bool supported;
+};
+
+void	buildKeyPad(const std::vector<uint8_t>& key, std::vector<uint8_t>& pad);
+const std::vector<XorKernel>& getXorKernels();
+XorFunction	selectXorKernel();
+void	xorCopyWithPad(uint8_t* destination, const uint8_t* source, size_t length, size_t keyOffset, const std::vector<uint8_t>& pad, XorFunction kernel);
+void	xorWithPad(uint8_t* data, size_t length, const std::vector<uint8_t>& pad, XorFunction kernel);